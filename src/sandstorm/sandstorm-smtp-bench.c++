@@ -0,0 +1,426 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Throughput and latency benchmark for the smtp bridge. Runs an smtp::SmtpServer in process,
+// delivering to a mock EmailSendPort that can be given an artificial latency, and drives it with
+// a number of concurrent SMTP clients on the same event loop, each sending messages from a corpus
+// of typical MIME shapes. Build and run with `make bench`.
+
+// Hack around stdlib bug with C++14.
+#include <initializer_list>  // force libstdc++ to include its config
+#undef _GLIBCXX_HAVE_GETS    // correct broken config
+// End hack.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+#include <kj/io.h>
+#include <algorithm>
+#include <sys/resource.h>
+
+#include <sandstorm/sandstorm-smtp-bridge.h>
+#include <sandstorm/sandstorm-smtp-mock.h>
+
+namespace sandstorm {
+
+typedef unsigned int uint;
+
+struct Shape {
+  // One kind of message in the corpus, ready to send as a DATA section.
+  kj::StringPtr name;
+  kj::String data;        // dot-stuffed and terminated with <CRLF>.<CRLF>
+  kj::Vector<uint64_t> latencies;
+  uint64_t sent = 0;
+};
+
+static kj::String base64Lines(size_t bytes, char seed) {
+  // `bytes` of base64 in 76-character lines, as an encoder would produce for an attachment.
+  static const char ALPHABET[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t lines = (bytes + 75) / 76;
+  auto result = kj::heapString(bytes + lines * 2);
+  char* out = result.begin();
+  uint32_t state = seed;
+  for (size_t i = 0; i < bytes; i++) {
+    state = state * 1103515245 + 12345;
+    *out++ = ALPHABET[(state >> 16) & 63];
+    if (i % 76 == 75 || i + 1 == bytes) {
+      *out++ = '\r';
+      *out++ = '\n';
+    }
+  }
+  return result;
+}
+
+static kj::String textLines(size_t bytes) {
+  // Plain prose-like ASCII in short lines, none starting with '.'.
+  static const char WORDS[] = "the quick brown fox jumps over the lazy dog ";
+  kj::Vector<char> result(bytes + 128);
+  size_t column = 0;
+  for (size_t i = 0; result.size() < bytes; i++) {
+    char c = WORDS[i % (sizeof(WORDS) - 1)];
+    if (column >= 70 && c == ' ') {
+      result.add('\r');
+      result.add('\n');
+      column = 0;
+      continue;
+    }
+    result.add(c);
+    ++column;
+  }
+  result.add('\r');
+  result.add('\n');
+  return kj::heapString(result.begin(), result.size());
+}
+
+static const char HEADERS[] =
+    "From: \"Bench Sender\" <sender@example.com>\r\n"
+    "To: recipient@example.com, \"Other, Person\" <other@example.com>\r\n"
+    "Subject: benchmark message\r\n"
+    "Message-Id: <bench@example.com>\r\n"
+    "Date: Thu, 1 Jan 2015 00:00:00 +0000\r\n"
+    "MIME-Version: 1.0\r\n";
+
+static kj::String makePlain() {
+  return kj::str(HEADERS, "Content-Type: text/plain; charset=us-ascii\r\n\r\n", textLines(2048),
+                 ".\r\n");
+}
+
+static kj::String makeAlternative() {
+  return kj::str(HEADERS,
+      "Content-Type: multipart/alternative; boundary=\"alt\"\r\n\r\n"
+      "--alt\r\nContent-Type: text/plain; charset=us-ascii\r\n\r\n", textLines(4096),
+      "--alt\r\nContent-Type: text/html; charset=us-ascii\r\n"
+      "Content-Transfer-Encoding: quoted-printable\r\n\r\n"
+      "<html><body><p style=3D\"color: black\">\r\n", textLines(6144), "</p></body></html>\r\n"
+      "--alt--\r\n.\r\n");
+}
+
+static kj::String makeAttachments(uint count, size_t size) {
+  kj::Vector<kj::String> parts;
+  for (uint i = 0; i < count; i++) {
+    parts.add(kj::str(
+        "--mixed\r\nContent-Type: application/pdf\r\n"
+        "Content-Disposition: attachment; filename=\"file", i, ".pdf\"\r\n"
+        "Content-Transfer-Encoding: base64\r\n\r\n", base64Lines(size, i)));
+  }
+  return kj::str(HEADERS,
+      "Content-Type: multipart/mixed; boundary=\"mixed\"\r\n\r\n"
+      "--mixed\r\nContent-Type: text/plain; charset=us-ascii\r\n\r\n", textLines(1024),
+      kj::strArray(parts, ""), "--mixed--\r\n.\r\n");
+}
+
+static const char EHLO[] = "EHLO bench.example.com\r\n";
+static const char ENVELOPE[] =
+    "MAIL FROM:<sender@example.com>\r\nRCPT TO:<recipient@example.com>\r\nDATA\r\n";
+static const char QUIT[] = "QUIT\r\n";
+
+class BenchClient {
+  // One SMTP client connection sending `count` messages back to back, each as a single
+  // pipelined MAIL/RCPT/DATA batch followed by the message.
+
+public:
+  BenchClient(kj::Own<kj::AsyncIoStream>&& stream, kj::ArrayPtr<Shape> shapes, uint index,
+              uint count)
+      : stream(kj::mv(stream)), shapes(shapes), next(index), remaining(count),
+        buffer(kj::heapArray<char>(4096)) {}
+
+  kj::Promise<void> run() {
+    return readReplies(1).then([this](uint code) {
+      return stream->write(EHLO, strlen(EHLO));
+    }).then([this]() {
+      return readReplies(1);
+    }).then([this](uint code) {
+      return sendMessages();
+    }).then([this]() {
+      return stream->write(QUIT, strlen(QUIT));
+    }).then([this]() {
+      return readReplies(1);
+    }).then([](uint code) {});
+  }
+
+  uint64_t bytesSent = 0;
+
+private:
+  kj::Own<kj::AsyncIoStream> stream;
+  kj::ArrayPtr<Shape> shapes;
+  uint next;
+  uint remaining;
+  kj::Array<char> buffer;
+  size_t start = 0;
+  size_t end = 0;
+
+  kj::Promise<void> sendMessages() {
+    if (remaining == 0) {
+      return kj::READY_NOW;
+    }
+    --remaining;
+    Shape* shape = &shapes[next++ % shapes.size()];
+    uint64_t began = smtp::nowNanos();
+    return stream->write(ENVELOPE, strlen(ENVELOPE)).then([this]() {
+      return readReplies(3);
+    }).then([this, shape](uint code) {
+      KJ_REQUIRE(code == 354, "DATA was not accepted", code);
+      return stream->write(shape->data.begin(), shape->data.size());
+    }).then([this]() {
+      return readReplies(1);
+    }).then([this, shape, began](uint code) {
+      shape->latencies.add(smtp::nowNanos() - began);
+      shape->sent++;
+      bytesSent += shape->data.size();
+      return sendMessages();
+    });
+  }
+
+  kj::Promise<uint> readReplies(uint count, uint lastCode = 0) {
+    // Reads `count` complete replies, multi-line ones counting once, and returns the code of the
+    // last. Any 4xx or 5xx reply is an error.
+    while (count > 0) {
+      auto newline = reinterpret_cast<char*>(memchr(buffer.begin() + start, '\n', end - start));
+      if (newline == nullptr) {
+        break;
+      }
+      kj::ArrayPtr<const char> line(buffer.begin() + start, newline);
+      start = newline + 1 - buffer.begin();
+      KJ_REQUIRE(line.size() >= 4, "malformed reply", kj::str(line));
+      uint code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+      if (line[3] == ' ') {
+        KJ_REQUIRE(code < 400, "server refused", kj::str(line));
+        lastCode = code;
+        --count;
+      }
+    }
+    if (count == 0) {
+      return lastCode;
+    }
+
+    memmove(buffer.begin(), buffer.begin() + start, end - start);
+    end -= start;
+    start = 0;
+    KJ_REQUIRE(end < buffer.size(), "reply too long");
+    return stream->tryRead(buffer.begin() + end, 1, buffer.size() - end)
+        .then([this, count, lastCode](size_t n) {
+      KJ_REQUIRE(n > 0, "server closed the connection");
+      end += n;
+      return readReplies(count, lastCode);
+    });
+  }
+};
+
+class SmtpBenchMain {
+public:
+  SmtpBenchMain(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "sandstorm-smtp-bench version: 0.0.1",
+                           "Measure how fast the smtp bridge accepts and delivers mail.")
+        .addOptionWithArg({'c', "clients"}, KJ_BIND_METHOD(*this, setClients), "<count>",
+            "Run <count> concurrent client connections. Default: 16.")
+        .addOptionWithArg({'n', "messages"}, KJ_BIND_METHOD(*this, setMessages), "<count>",
+            "Send <count> messages per client. Default: 50.")
+        .addOptionWithArg({'l', "latency"}, KJ_BIND_METHOD(*this, setLatency), "<ms>",
+            "Make the mock grain take <ms> milliseconds to accept each message. Default: 0.")
+        .addOptionWithArg({"shapes"}, KJ_BIND_METHOD(*this, setShapes), "<list>",
+            "Comma-separated message shapes to cycle through, from plain, alternative, "
+            "attachments and huge. Default: all of them.")
+        .addOptionWithArg({"delivery-window"}, KJ_BIND_METHOD(*this, setDeliveryWindow), "<count>",
+            "Passed to the delivery queue, as for the bridge. Default: 4.")
+        .addOption({"ack-after-delivery"}, KJ_BIND_METHOD(*this, setAckAfterDelivery),
+            "Include delivery to the mock grain in each message's latency.")
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+  kj::MainBuilder::Validity setClients(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 10000) {
+        clients = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 10000";
+  }
+
+  kj::MainBuilder::Validity setMessages(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 1000000) {
+        messages = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 1000000";
+  }
+
+  kj::MainBuilder::Validity setLatency(kj::StringPtr arg) {
+    return smtp::parseLatency(arg, latencyMs);
+  }
+
+  kj::MainBuilder::Validity setShapes(kj::StringPtr arg) {
+    shapeNames = kj::heapString(arg);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDeliveryWindow(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 1024) {
+        deliveryOptions.maxInFlight = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 1024";
+  }
+
+  kj::MainBuilder::Validity setAckAfterDelivery() {
+    deliveryOptions.ackAfterDelivery = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    auto shapes = buildCorpus();
+    if (shapes.size() == 0) {
+      return "no shapes selected";
+    }
+
+    auto io = kj::setupAsyncIo();
+    auto& timer = io.provider->getTimer();
+    auto mock = kj::heap<smtp::MockEmailSendPort>(timer, latencyMs);
+    auto& mockRef = *mock;
+    smtp::SingleSendPort grain(kj::mv(mock));
+
+    // Nothing is refused for lack of room; the queue is part of what's being measured.
+    deliveryOptions.maxQueuedBytes = UINT64_MAX;
+    smtp::DeliveryQueue queue(grain, deliveryOptions);
+    smtp::ReceiveOptions receiveOptions;
+    receiveOptions.maxConnections = 0;
+
+    smtp::SocketListener listener(io.unixEventPort, *io.lowLevelProvider,
+                                  smtp::listenSocket(INADDR_LOOPBACK, 0));
+    smtp::SmtpServer server(queue, receiveOptions, timer);
+    auto serverTask = server.listen(listener).eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "accept loop failed", exception);
+    });
+
+    auto connectTo = io.provider->getNetwork()
+        .parseAddress("127.0.0.1", listener.getPort()).wait(io.waitScope);
+
+    uint64_t began = smtp::nowNanos();
+    kj::Vector<kj::Own<BenchClient>> benchClients;
+    kj::Vector<kj::Promise<void>> running;
+    for (uint i = 0; i < clients; i++) {
+      auto stream = connectTo->connect().wait(io.waitScope);
+      auto client = kj::heap<BenchClient>(kj::mv(stream), shapes, i, messages);
+      running.add(client->run());
+      benchClients.add(kj::mv(client));
+    }
+    kj::joinPromises(running.releaseAsArray()).wait(io.waitScope);
+    uint64_t accepted = smtp::nowNanos();
+
+    uint64_t total = (uint64_t)clients * messages;
+    queue.whenIdle().wait(io.waitScope);
+    uint64_t delivered = smtp::nowNanos();
+
+    uint64_t bytes = 0;
+    for (auto& client: benchClients) {
+      bytes += client->bytesSent;
+    }
+    report(shapes, total, bytes, accepted - began, delivered - began, queue.getStats(), mockRef);
+    return true;
+  }
+
+private:
+  kj::ProcessContext& context;
+  uint clients = 16;
+  uint messages = 50;
+  uint latencyMs = 0;
+  kj::String shapeNames = kj::heapString("plain,alternative,attachments,huge");
+  smtp::DeliveryOptions deliveryOptions;
+
+  kj::Array<Shape> buildCorpus() {
+    kj::Vector<Shape> result;
+    for (auto name: smtp::split(shapeNames, ',')) {
+      Shape shape;
+      if (name == kj::StringPtr("plain").asArray()) {
+        shape.name = "plain";
+        shape.data = makePlain();
+      } else if (name == kj::StringPtr("alternative").asArray()) {
+        shape.name = "alternative";
+        shape.data = makeAlternative();
+      } else if (name == kj::StringPtr("attachments").asArray()) {
+        shape.name = "attachments";
+        shape.data = makeAttachments(30, 64 << 10);
+      } else if (name == kj::StringPtr("huge").asArray()) {
+        shape.name = "huge";
+        shape.data = makeAttachments(1, 8 << 20);
+      } else {
+        context.exitError(kj::str("unknown shape: ", name));
+      }
+      result.add(kj::mv(shape));
+    }
+    return result.releaseAsArray();
+  }
+
+  static double percentileMs(kj::ArrayPtr<uint64_t> sorted, double fraction) {
+    if (sorted.size() == 0) {
+      return 0;
+    }
+    size_t i = kj::min(sorted.size() - 1, (size_t)(fraction * sorted.size()));
+    return sorted[i] / 1e6;
+  }
+
+  void printLatencies(kj::StringPtr label, kj::ArrayPtr<uint64_t> latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    smtp::printLine(kj::str(label, ": ", latencies.size(), " messages, "
+        "p50 ", percentileMs(latencies, 0.5), " ms, "
+        "p99 ", percentileMs(latencies, 0.99), " ms, "
+        "p999 ", percentileMs(latencies, 0.999), " ms"));
+  }
+
+  void report(kj::ArrayPtr<Shape> shapes, uint64_t total, uint64_t bytes, uint64_t acceptNanos,
+              uint64_t deliverNanos, const smtp::DeliveryQueue::Stats& stats,
+              smtp::MockEmailSendPort& mock) {
+    double acceptSeconds = acceptNanos / 1e9;
+    double deliverSeconds = deliverNanos / 1e9;
+    struct rusage usage;
+    KJ_SYSCALL(getrusage(RUSAGE_SELF, &usage));
+
+    smtp::printLine(kj::str(
+        clients, " clients, ", total, " messages, ", bytes / (1 << 20), " MiB, "
+        "mock latency ", latencyMs, " ms"));
+    smtp::printLine(kj::str(
+        "accepted: ", total / acceptSeconds, " msgs/s, ",
+        bytes / acceptSeconds / (1 << 20), " MiB/s"));
+    smtp::printLine(kj::str(
+        "delivered: ", total / deliverSeconds, " msgs/s, ",
+        bytes / deliverSeconds / (1 << 20), " MiB/s, ",
+        stats.failed, " failed, peak queue ", stats.peakQueuedBytes / (1 << 20), " MiB, ",
+        mock.receivedWords * sizeof(capnp::word) / (1 << 20), " MiB delivered as capnp"));
+
+    kj::Vector<uint64_t> all;
+    for (auto& shape: shapes) {
+      for (auto latency: shape.latencies) {
+        all.add(latency);
+      }
+      printLatencies(kj::str("  ", shape.name), shape.latencies);
+    }
+    printLatencies("all", all);
+    smtp::printLine(kj::str("peak RSS: ", usage.ru_maxrss / 1024, " MiB"));
+    smtp::printLine(smtp::globalStats().format());
+  }
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::SmtpBenchMain)
@@ -40,15 +40,21 @@
 #include <capnp/rpc-twoparty.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/ez-rpc.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include <sandstorm/sandstorm-smtp-bridge.h>
+#include <sandstorm/sandstorm-smtp-rpc.h>
+#include <sandstorm/sandstorm-smtp-threads.h>
 
 namespace sandstorm {
 
 typedef unsigned int uint;
 typedef unsigned char byte;
 
+static const uint32_t SMTP_ADDRESS = INADDR_LOOPBACK;
+static const uint16_t SMTP_PORT = 30125;
+
 class TestSmtpMain {
 public:
   class ErrorHandlerImpl: public kj::TaskSet::ErrorHandler {
@@ -62,50 +68,380 @@ public:
 
   kj::MainFunc getMain() {
     return kj::MainBuilder(context, "test-smtp version: 0.0.1", "test the smtp server")
+        .addOptionWithArg({"delivery-window"}, KJ_BIND_METHOD(*this, setDeliveryWindow), "<count>",
+            "Allow at most <count> messages to be in the middle of delivery to the grain at once. "
+            "Default: 4.")
+        .addOptionWithArg({"queue-limit"}, KJ_BIND_METHOD(*this, setQueueLimit), "<bytes>",
+            "Answer new mail transactions with 452 while at least <bytes> of accepted mail is "
+            "waiting to be delivered. Default: 256MiB.")
+        .addOption({"ack-after-delivery"}, KJ_BIND_METHOD(*this, setAckAfterDelivery),
+            "Don't send the final 250 for a message until the grain has accepted it.")
+        .addOptionWithArg({"spool"}, KJ_BIND_METHOD(*this, setSpool), "<dir>",
+            "Write each accepted message to a spool in <dir> before acknowledging it, and deliver "
+            "anything left there from a previous run on startup.")
+        .addOptionWithArg({"threads"}, KJ_BIND_METHOD(*this, setThreads), "<count>",
+            "Accept and parse mail on <count> worker threads, each with its own listening socket, "
+            "and keep only delivery to the grain on the main thread. With --spool, the main "
+            "thread also writes each message to the spool, and parses it when delivering it. "
+            "Default: 0 (do everything on the main thread).")
+        .addOptionWithArg({"max-message-size"}, KJ_BIND_METHOD(*this, setMaxMessageSize), "<bytes>",
+            "Advertise SIZE <bytes> and refuse larger messages with 552. Default: 64MiB.")
+        .addOptionWithArg({"memory-budget"}, KJ_BIND_METHOD(*this, setMemoryBudget), "<bytes>",
+            "Keep at most <bytes> of messages in memory across all connections, counting both "
+            "those being received and those waiting for delivery; the rest go to temporary "
+            "files. 0 means no limit beyond --spill-threshold. Default: 64MiB.")
+        .addOptionWithArg({"spill-threshold"}, KJ_BIND_METHOD(*this, setSpillThreshold), "<bytes>",
+            "Move any message larger than <bytes> to a temporary file while receiving it. "
+            "Default: 1MiB.")
+        .addOptionWithArg({"spill-dir"}, KJ_BIND_METHOD(*this, setSpillDir), "<dir>",
+            "Create temporary files for large messages in <dir>. They are written with blocking "
+            "writes that hold up every other connection on the same thread, so <dir> should be "
+            "on fast local storage, e.g. a tmpfs. Default: /tmp.")
+        .addOptionWithArg({"decode-threads"}, KJ_BIND_METHOD(*this, setDecodeThreads), "<count>",
+            "Decode large attachments of a message in parallel on a pool of <count> threads. "
+            "Default: 0 (decode them one after another).")
+        .addOptionWithArg({"grain-connections"}, KJ_BIND_METHOD(*this, setGrainConnections), "<count>",
+            "Spread deliveries to the grain over <count> separate connections to sandstorm-api. "
+            "Default: 2.")
+        .addOptionWithArg({"delivery-attempts"}, KJ_BIND_METHOD(*this, setDeliveryAttempts), "<count>",
+            "Send a message up to <count> times when the connection to the grain breaks while "
+            "it is being delivered. Default: 3.")
+        .addOptionWithArg({"command-timeout"}, KJ_BIND_METHOD(*this, setCommandTimeout), "<seconds>",
+            "Disconnect clients that take longer than <seconds> to send a command or to read our "
+            "replies. Default: 300.")
+        .addOptionWithArg({"data-timeout"}, KJ_BIND_METHOD(*this, setDataTimeout), "<seconds>",
+            "Allow <seconds>, plus time for the data received so far at --min-data-rate, for "
+            "each DATA section or BDAT chunk. Default: 180.")
+        .addOptionWithArg({"min-data-rate"}, KJ_BIND_METHOD(*this, setMinDataRate), "<bytes>",
+            "Expect message data to arrive at <bytes> per second or faster. Default: 1024.")
+        .addOptionWithArg({"max-connections"}, KJ_BIND_METHOD(*this, setMaxConnections), "<count>",
+            "Serve at most <count> clients at once, per thread with --threads, and stop accepting "
+            "until one leaves. 0 means no limit. Default: 1000.")
+        .addOptionWithArg({"max-connections-per-address"},
+            KJ_BIND_METHOD(*this, setMaxConnectionsPerAddress), "<count>",
+            "Turn away a client's connection with 421 while <count> others from the same address "
+            "are being served, per thread with --threads. 0 means no limit. Default: 0.")
+        .addOptionWithArg({"capture-dir"}, KJ_BIND_METHOD(*this, setCaptureDir), "<dir>",
+            "Record everything each client sends, with the timing of each read, to a new file in "
+            "<dir>, for replaying with sandstorm-smtp-replay.")
+        .addOptionWithArg({"stats-interval"}, KJ_BIND_METHOD(*this, setStatsInterval), "<seconds>",
+            "Every <seconds>, write per-stage latency percentiles and traffic counters to stderr.")
+        .addOptionWithArg({"stats-socket"}, KJ_BIND_METHOD(*this, setStatsSocket), "<path>",
+            "Listen on the unix socket <path> and write the same stats to each client that "
+            "connects.")
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
         .build();
   }
 
-  struct AcceptedConnection {
-    kj::Own<kj::AsyncIoStream> connection;
-    capnp::TwoPartyVatNetwork network;
-    capnp::RpcSystem<capnp::rpc::twoparty::SturdyRefHostId> rpcSystem;
+  kj::MainBuilder::Validity setDeliveryWindow(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 1024) {
+        deliveryOptions.maxInFlight = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 1024";
+  }
 
-    explicit AcceptedConnection(kj::Own<kj::AsyncIoStream>&& connectionParam)
-        : connection(kj::mv(connectionParam)),
-          network(*connection, capnp::rpc::twoparty::Side::CLIENT),
-          rpcSystem(capnp::makeRpcClient(network)) {}
-  };
+  kj::MainBuilder::Validity setQueueLimit(kj::StringPtr arg) {
+    KJ_IF_MAYBE(bytes, smtp::parseUInt(arg)) {
+      deliveryOptions.maxQueuedBytes = *bytes;
+      return true;
+    }
+    return "must be a number of bytes";
+  }
+
+  kj::MainBuilder::Validity setAckAfterDelivery() {
+    deliveryOptions.ackAfterDelivery = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setSpool(kj::StringPtr arg) {
+    spoolDirectory = kj::heapString(arg);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setThreads(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count <= 256) {
+        threadCount = *count;
+        return true;
+      }
+    }
+    return "must be a number between 0 and 256";
+  }
+
+  kj::MainBuilder::Validity setMaxMessageSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(bytes, smtp::parseUInt(arg)) {
+      if (*bytes > 0) {
+        receiveOptions.maxMessageSize = *bytes;
+        return true;
+      }
+    }
+    return "must be a positive number of bytes";
+  }
+
+  kj::MainBuilder::Validity setMemoryBudget(kj::StringPtr arg) {
+    KJ_IF_MAYBE(bytes, smtp::parseUInt(arg)) {
+      memoryBudget = *bytes;
+      return true;
+    }
+    return "must be a number of bytes";
+  }
+
+  kj::MainBuilder::Validity setSpillThreshold(kj::StringPtr arg) {
+    KJ_IF_MAYBE(bytes, smtp::parseUInt(arg)) {
+      receiveOptions.spillThreshold = *bytes;
+      return true;
+    }
+    return "must be a number of bytes";
+  }
+
+  kj::MainBuilder::Validity setSpillDir(kj::StringPtr arg) {
+    spillDirectory = kj::heapString(arg);
+    receiveOptions.spillDirectory = spillDirectory;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDecodeThreads(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count <= 256) {
+        decodeThreadCount = *count;
+        return true;
+      }
+    }
+    return "must be a number between 0 and 256";
+  }
+
+  kj::MainBuilder::Validity setGrainConnections(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 64) {
+        grainConnections = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 64";
+  }
+
+  kj::MainBuilder::Validity setDeliveryAttempts(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 100) {
+        deliveryOptions.maxAttempts = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 100";
+  }
+
+  kj::MainBuilder::Validity setCommandTimeout(kj::StringPtr arg) {
+    KJ_IF_MAYBE(seconds, smtp::parseUInt(arg)) {
+      if (*seconds > 0 && *seconds <= 86400) {
+        receiveOptions.commandTimeout = *seconds * kj::SECONDS;
+        return true;
+      }
+    }
+    return "must be a number of seconds between 1 and 86400";
+  }
+
+  kj::MainBuilder::Validity setDataTimeout(kj::StringPtr arg) {
+    KJ_IF_MAYBE(seconds, smtp::parseUInt(arg)) {
+      if (*seconds > 0 && *seconds <= 86400) {
+        receiveOptions.dataTimeout = *seconds * kj::SECONDS;
+        return true;
+      }
+    }
+    return "must be a number of seconds between 1 and 86400";
+  }
+
+  kj::MainBuilder::Validity setMinDataRate(kj::StringPtr arg) {
+    KJ_IF_MAYBE(bytes, smtp::parseUInt(arg)) {
+      if (*bytes > 0) {
+        receiveOptions.minDataRate = *bytes;
+        return true;
+      }
+    }
+    return "must be a positive number of bytes";
+  }
+
+  kj::MainBuilder::Validity setMaxConnections(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count <= 1000000) {
+        receiveOptions.maxConnections = *count;
+        return true;
+      }
+    }
+    return "must be a number up to 1000000";
+  }
+
+  kj::MainBuilder::Validity setMaxConnectionsPerAddress(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count <= 1000000) {
+        receiveOptions.maxConnectionsPerAddress = *count;
+        return true;
+      }
+    }
+    return "must be a number up to 1000000";
+  }
+
+  kj::MainBuilder::Validity setCaptureDir(kj::StringPtr arg) {
+    captureDirectory = kj::heapString(arg);
+    receiveOptions.captureDirectory = captureDirectory;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setStatsInterval(kj::StringPtr arg) {
+    KJ_IF_MAYBE(seconds, smtp::parseUInt(arg)) {
+      if (*seconds > 0 && *seconds <= 86400) {
+        statsInterval = *seconds;
+        return true;
+      }
+    }
+    return "must be a number of seconds between 1 and 86400";
+  }
+
+  kj::MainBuilder::Validity setStatsSocket(kj::StringPtr arg) {
+    statsSocket = kj::heapString(arg);
+    return true;
+  }
+
+  kj::String statsReport(smtp::DeliveryQueue& queue) {
+    auto& stats = queue.getStats();
+    uint64_t rejected = stats.rejected;
+    KJ_IF_MAYBE(h, hub) {
+      rejected += h->getRejected();
+    }
+    return kj::str(smtp::globalStats().format(),
+        "delivery queue: ", stats.queuedMessages, " waiting, ", stats.inFlight, " in flight, ",
+        stats.queuedBytes, " bytes (peak ", stats.peakQueuedBytes, "), ", stats.delivered,
+        " delivered, ", stats.failed, " failed, ", stats.retried, " retried, ", rejected,
+        " rejected\n");
+  }
+
+  kj::Promise<void> dumpStats(smtp::DeliveryQueue& queue) {
+    return ioContext.provider->getTimer().afterDelay(statsInterval * kj::SECONDS)
+        .then([this, &queue]() {
+      auto report = statsReport(queue);
+      kj::FdOutputStream(STDERR_FILENO).write(report.begin(), report.size());
+      return dumpStats(queue);
+    });
+  }
+
+  kj::Promise<void> serveStats(kj::ConnectionReceiver& listener, kj::TaskSet& tasks,
+                               smtp::DeliveryQueue& queue) {
+    return listener.accept().then([this, &listener, &tasks, &queue](
+        kj::Own<kj::AsyncIoStream>&& connection) {
+      auto report = statsReport(queue);
+      auto promise = connection->write(report.begin(), report.size());
+      tasks.add(promise.attach(kj::mv(report), kj::mv(connection)));
+      return serveStats(listener, tasks, queue);
+    });
+  }
+
+  static void runWorker(smtp::WorkerDeliveryHub& hub, uint index,
+                        const smtp::ReceiveOptions& receiveOptions) {
+    // Worker thread: serves SMTP on its own event loop and socket.
+    auto io = kj::setupAsyncIo();
+    smtp::RemoteDeliveryQueue queue(hub, index, *io.lowLevelProvider);
+    smtp::SocketListener listener(io.unixEventPort, *io.lowLevelProvider,
+                                  smtp::listenSocket(SMTP_ADDRESS, SMTP_PORT, true));
+    smtp::SmtpServer server(queue, receiveOptions, io.provider->getTimer());
+    server.listen(listener).wait(io.waitScope);
+  }
 
   kj::MainBuilder::Validity run() {
       ErrorHandlerImpl errorHandler;
       kj::TaskSet tasks(errorHandler);
 
-      kj::Own<AcceptedConnection> acceptedConnection;
-      auto connection = ioContext.provider->getNetwork().parseAddress("unix:/tmp/sandstorm-api").then([](auto addr) {
-        return addr->connect();
-      }).then([&](auto connection) {
-        acceptedConnection = kj::heap<AcceptedConnection>(kj::mv(connection));
-      });
-
-      EmailSendPort::Client session(connection.then([&]() {
-        capnp::MallocMessageBuilder message;
-        auto hostIdOrphan = message.getOrphanage().newOrphan<capnp::rpc::twoparty::SturdyRefHostId>();
-        auto hostId = hostIdOrphan.get();
-        auto objectId = message.getRoot<capnp::AnyPointer>();
-        hostId.setSide(capnp::rpc::twoparty::Side::SERVER);
-        objectId.setAs<capnp::Text>("HackSessionContext");
-        return acceptedConnection->rpcSystem.restore(hostId, objectId).template castAs<EmailSendPort>();
-      }));
-
-      auto acceptTask = ioContext.provider->getNetwork()
-          .parseAddress("127.0.0.1", 30125)
-          .then([&](kj::Own<kj::NetworkAddress>&& addr) {
-        auto serverPort = addr->listen();
-        auto promise = smtp::runServer(*serverPort, tasks, session);
-        return promise.attach(kj::mv(serverPort));
-      });
-      acceptTask.wait(ioContext.waitScope);
+      smtp::GrainConnectionPool grain(*ioContext.provider, "unix:/tmp/sandstorm-api",
+                                      grainConnections);
+
+      kj::Maybe<kj::Own<smtp::Spool>> spool;
+      kj::Maybe<smtp::Spool&> spoolRef;
+      KJ_IF_MAYBE(directory, spoolDirectory) {
+        auto ownSpool = kj::heap<smtp::Spool>(*directory, *ioContext.lowLevelProvider);
+        spoolRef = *ownSpool;
+        spool = kj::mv(ownSpool);
+      }
+
+      kj::Maybe<kj::Own<smtp::DecodePool>> decodePool;
+      if (decodeThreadCount > 0) {
+        auto pool = kj::heap<smtp::DecodePool>(decodeThreadCount);
+        deliveryOptions.decodePool = pool.get();
+        decodePool = kj::mv(pool);
+      }
+
+      kj::Maybe<kj::Own<smtp::MemoryBudget>> budget;
+      if (memoryBudget > 0) {
+        auto ownBudget = kj::heap<smtp::MemoryBudget>(memoryBudget);
+        receiveOptions.memoryBudget = ownBudget.get();
+        budget = kj::mv(ownBudget);
+      }
+
+      smtp::DeliveryQueue deliveryQueue(grain, deliveryOptions, spoolRef,
+                                        ioContext.lowLevelProvider.get());
+      KJ_IF_MAYBE(s, spoolRef) {
+        for (auto& record: s->recover()) {
+          deliveryQueue.enqueue(kj::mv(record));
+        }
+      }
+
+      if (statsInterval > 0) {
+        tasks.add(dumpStats(deliveryQueue));
+      }
+      KJ_IF_MAYBE(path, statsSocket) {
+        if (unlink(path->cStr()) < 0 && errno != ENOENT) {
+          KJ_FAIL_SYSCALL("unlink", errno, *path);
+        }
+        auto listener = ioContext.provider->getNetwork()
+            .parseAddress(kj::str("unix:", *path)).wait(ioContext.waitScope)->listen();
+        auto& listenerRef = *listener;
+        tasks.add(serveStats(listenerRef, tasks, deliveryQueue).attach(kj::mv(listener)));
+      }
+
+      if (threadCount > 0) {
+        smtp::initGMime();
+
+        smtp::WorkerDeliveryHub hub(deliveryQueue, threadCount, *ioContext.lowLevelProvider);
+        this->hub = hub;
+        KJ_DEFER(this->hub = nullptr);
+        // Workers only ever stop by failing. They report it here, and the process exits rather
+        // than limp along without them.
+        smtp::CrossThreadQueue<kj::Exception> failures;
+        failures.bind(*ioContext.lowLevelProvider);
+        auto workerFailed = failures.receive().then([](kj::Vector<kj::Exception>&& exceptions) {
+          for (size_t i = 1; i < exceptions.size(); i++) {
+            KJ_LOG(ERROR, "worker thread failed", exceptions[i]);
+          }
+          kj::throwFatalException(kj::mv(exceptions[0]));
+        });
+
+        auto workers = kj::heapArrayBuilder<kj::Own<kj::Thread>>(threadCount);
+        for (uint i = 0; i < threadCount; i++) {
+          smtp::WorkerDeliveryHub* hubPtr = &hub;
+          const smtp::ReceiveOptions* optionsPtr = &receiveOptions;
+          smtp::CrossThreadQueue<kj::Exception>* failuresPtr = &failures;
+          workers.add(kj::heap<kj::Thread>([hubPtr, i, optionsPtr, failuresPtr]() {
+            KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+              runWorker(*hubPtr, i, *optionsPtr);
+            })) {
+              failuresPtr->send(kj::mv(*exception));
+            }
+          }));
+        }
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+          hub.run().exclusiveJoin(kj::mv(workerFailed)).wait(ioContext.waitScope);
+        })) {
+          // Exit without unwinding: the remaining workers can't be stopped, so joining them
+          // would wait forever.
+          context.exitError(kj::str(*exception));
+        }
+        return true;
+      }
+
+      smtp::SocketListener listener(ioContext.unixEventPort, *ioContext.lowLevelProvider,
+                                    smtp::listenSocket(SMTP_ADDRESS, SMTP_PORT));
+      smtp::SmtpServer server(deliveryQueue, receiveOptions, ioContext.provider->getTimer());
+      server.listen(listener).wait(ioContext.waitScope);
     return true;
   }
 
@@ -113,6 +449,19 @@ private:
   kj::ProcessContext& context;
   kj::AsyncIoContext ioContext;
   kj::String url;
+  smtp::DeliveryOptions deliveryOptions;
+  kj::Maybe<kj::String> spoolDirectory;
+  uint threadCount = 0;
+  uint decodeThreadCount = 0;
+  smtp::ReceiveOptions receiveOptions;
+  uint64_t memoryBudget = 64ull << 20;
+  kj::String spillDirectory;
+  kj::String captureDirectory;
+  uint grainConnections = 2;
+  uint statsInterval = 0;
+  kj::Maybe<kj::String> statsSocket;
+  kj::Maybe<smtp::WorkerDeliveryHub&> hub;
+  // Set while the worker threads are running, so their rejections can be reported.
 };
 
 }  // namespace sandstorm
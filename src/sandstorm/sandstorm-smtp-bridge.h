@@ -20,39 +20,59 @@
 #pragma once
 
 #include <kj/debug.h>
+#include <kj/arena.h>
 #include <kj/async-io.h>
+#include <kj/async-unix.h>
 #include <capnp/serialize.h>
 #include <gmime/gmime.h>
 // requires libgpgme11-dev libgmime-2.6-dev libselinux1-dev
 #include <sandstorm/email.capnp.h>
+#include <sandstorm/sandstorm-smtp-capture.h>
+#include <sandstorm/sandstorm-smtp-decode.h>
+#include <sandstorm/sandstorm-smtp-headers.h>
+#include <sandstorm/sandstorm-smtp-pool.h>
+#include <sandstorm/sandstorm-smtp-spool.h>
+#include <sandstorm/sandstorm-smtp-stats.h>
+#include <array>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 
 namespace sandstorm {
   namespace smtp {
 
   static const char * END_LINE = "\r\n";
-  static const char * END_BODY = "\r\n.\r\n";
 
   #define STRING_AND_SIZE(str) str "\r\n", sizeof(str) + 1
 
+  static const char * RAW_STREAM_KEY = "sandstorm-smtp-raw-stream";
+  // Object data key under which parse_message() keeps the stream a message was parsed from.
+
+  inline void initGMime() {
+    // GMime's global setup isn't thread-safe and must run once per process before any parsing.
+    static bool initialized = (g_mime_init(0), g_mime_charset_map_init(), g_mime_iconv_init(), true);
+    (void)initialized;
+  }
+
   static GMimeMessage *
-  parse_message (kj::StringPtr str)
+  parse_message (GMimeStream *stream)
   {
-    g_mime_init(0); //only one time
-            g_mime_charset_map_init();
-            g_mime_iconv_init();
+    initGMime();
+    StageTimer timer(Stage::PARSE);
     GMimeMessage *message;
     GMimeParser *parser;
-    GMimeStream *stream;
 
-    /* create a stream to read from the file descriptor */
-    stream = g_mime_stream_mem_new_with_buffer (str.cStr(), str.size());
-
-    /* create a new parser object to parse the stream */
+    /* create a new parser object to parse the stream. With a seekable stream the parser keeps
+     * parts as substreams of it rather than copying their content out. */
     parser = g_mime_parser_new_with_stream (stream);
-
-    /* unref the stream (parser owns a ref, so this object does not actually get free'd until we destroy the parser) */
-    g_object_unref (stream);
+    g_mime_parser_set_persist_stream (parser, TRUE);
 
     /* parse the message from the stream */
     message = g_mime_parser_construct_message (parser);
@@ -60,6 +80,25 @@ namespace sandstorm {
     /* free the parser */
     g_object_unref (parser);
 
+    /* keep the raw stream reachable, so headers can be read straight from it */
+    if (message != NULL) {
+      g_object_set_data_full (G_OBJECT (message), RAW_STREAM_KEY, g_object_ref (stream), g_object_unref);
+    }
+
+    return message;
+  }
+
+  static GMimeMessage *
+  parse_message (kj::StringPtr str)
+  {
+    /* create a stream to read from the string */
+    GMimeStream *stream = g_mime_stream_mem_new_with_buffer (str.cStr(), str.size());
+
+    GMimeMessage *message = parse_message (stream);
+
+    /* the message holds its own refs on the stream */
+    g_object_unref (stream);
+
     return message;
   }
 
@@ -98,7 +137,7 @@ namespace sandstorm {
     return input;
   }
 
-  inline kj::Maybe<size_t> findFirst(kj::StringPtr str, char c, size_t start = 0) {
+  inline kj::Maybe<size_t> findFirst(kj::ArrayPtr<const char> str, char c, size_t start = 0) {
     if (start >= str.size()) return nullptr;
     const char* pos = reinterpret_cast<const char*>(memchr(str.begin() + start, c, str.size() - start));
     if (pos == nullptr) {
@@ -108,13 +147,14 @@ namespace sandstorm {
     }
   };
 
-  inline kj::Maybe<size_t> find(kj::StringPtr haystack, kj::StringPtr needle, size_t start = 0) {
+  inline kj::Maybe<size_t> find(kj::ArrayPtr<const char> haystack, kj::ArrayPtr<const char> needle,
+                                size_t start = 0) {
     if (needle.size() == 0 || haystack.size() == 0) return nullptr;
     if (needle.size() > haystack.size()) return nullptr;
     while (true) {
       KJ_IF_MAYBE(pos, findFirst(haystack, needle[0], start)) {
         if (*pos + needle.size() > haystack.size()) return nullptr;
-        if (haystack.slice(*pos, *pos + needle.size()) == needle.slice(0, needle.size())) {
+        if (haystack.slice(*pos, *pos + needle.size()) == needle) {
           return *pos;
         } else {
           start = *pos + 1;
@@ -125,6 +165,18 @@ namespace sandstorm {
     }
   };
 
+  kj::Maybe<uint64_t> parseUInt(kj::ArrayPtr<const char> text) {
+    if (text.size() == 0) return nullptr;
+    uint64_t result = 0;
+    for (char c: text) {
+      if (c < '0' || c > '9') return nullptr;
+      uint64_t next = result * 10 + (c - '0');
+      if (next / 10 != result) return nullptr;  // overflow
+      result = next;
+    }
+    return result;
+  }
+
   void toLower(kj::ArrayPtr<char> text) {
     for (char& c: text) {
       if ('A' <= c && c <= 'Z') {
@@ -133,358 +185,2449 @@ namespace sandstorm {
     }
   }
 
-  struct AcceptedConnection {
-    kj::Own<kj::AsyncIoStream> connection;
-    EmailSendPort::Client& emailCap;
-    kj::String lastBuffer;
-    char buf[1024];
+  constexpr uint32_t packVerb(const char* name) {
+    return uint32_t(uint8_t(name[0])) | uint32_t(uint8_t(name[1])) << 8 |
+           uint32_t(uint8_t(name[2])) << 16 | uint32_t(uint8_t(name[3])) << 24;
+  }
 
-    explicit AcceptedConnection(kj::Own<kj::AsyncIoStream>&& connectionParam, EmailSendPort::Client& emailCap)
-        : connection(kj::mv(connectionParam)), emailCap(emailCap), lastBuffer(kj::str("")) { }
+  enum class Verb: uint32_t {
+    // Every SMTP verb we handle is four letters, so each is identified by its lowercase letters
+    // packed into one word, and a command line is matched with a single load and compare.
+    UNKNOWN = 0,
+    EHLO = packVerb("ehlo"),
+    HELO = packVerb("helo"),
+    MAIL = packVerb("mail"),
+    RCPT = packVerb("rcpt"),
+    DATA = packVerb("data"),
+    BDAT = packVerb("bdat"),
+    RSET = packVerb("rset"),
+    NOOP = packVerb("noop"),
+    QUIT = packVerb("quit"),
+  };
 
-    kj::Promise<kj::String> readUntilHelper(kj::String&& delimiter, kj::Vector<kj::String>&& output) {
-      return connection->tryRead(buf, 1, sizeof(buf) - 1).then([&, delimiter=kj::mv(delimiter), output=kj::mv(output)](size_t size) mutable -> kj::Promise<kj::String>  {
-        if (size == 0) {
-          return kj::strArray(output, "");
-        }
+  inline Verb parseVerb(kj::ArrayPtr<const char> line) {
+    // Identifies the verb at the start of `line`, ignoring case, without copying it. Setting the
+    // 0x20 bit lowercases ASCII letters and can't turn anything else into one.
+    if (line.size() < 4 || (line.size() > 4 && line[4] != ' ')) {
+      return Verb::UNKNOWN;
+    }
+    uint32_t packed = packVerb(line.begin()) | 0x20202020;
+    switch (packed) {
+      case uint32_t(Verb::EHLO):
+      case uint32_t(Verb::HELO):
+      case uint32_t(Verb::MAIL):
+      case uint32_t(Verb::RCPT):
+      case uint32_t(Verb::DATA):
+      case uint32_t(Verb::BDAT):
+      case uint32_t(Verb::RSET):
+      case uint32_t(Verb::NOOP):
+      case uint32_t(Verb::QUIT):
+        return Verb(packed);
+      default:
+        return Verb::UNKNOWN;
+    }
+  }
 
-        buf[size] = '\0';
-        kj::StringPtr line(buf, size);
-        // TODO(someday): don't search all lines, just look at the minimum amount needed
-        kj::String all = kj::str(kj::strArray(output, ""), line);
+  kj::Maybe<kj::ArrayPtr<const char>> parsePath(kj::ArrayPtr<const char> args, kj::StringPtr keyword,
+                                                kj::ArrayPtr<const char>& params) {
+    // Parses the " FROM:<path> params" of MAIL or the " TO:<path> params" of RCPT, with
+    // `keyword` the lowercase "from:" or "to:". Returns the path without its angle brackets
+    // (empty for the null path "<>") and sets `params` to what follows. The brackets may be
+    // missing, as some clients leave them out.
+    args = trim(args);
+    if (args.size() < keyword.size() || strncasecmp(args.begin(), keyword.cStr(), keyword.size()) != 0) {
+      return nullptr;
+    }
+    args = trim(args.slice(keyword.size(), args.size()));
+
+    kj::ArrayPtr<const char> path;
+    if (args.size() > 0 && args[0] == '<') {
+      KJ_IF_MAYBE(close, findFirst(args, '>')) {
+        path = args.slice(1, *close);
+        params = args.slice(*close + 1, args.size());
+      } else {
+        return nullptr;
+      }
+    } else {
+      path = args;
+      params = nullptr;
+      KJ_IF_MAYBE(space, findFirst(args, ' ')) {
+        path = args.slice(0, *space);
+        params = args.slice(*space + 1, args.size());
+      }
+      if (path.size() == 0) {
+        return nullptr;
+      }
+    }
+    return path;
+  }
 
-        KJ_IF_MAYBE(pos, find(all, delimiter)) {
-          lastBuffer = kj::heapString(all.slice(*pos + delimiter.size()));
+  class MemoryBudget {
+    // How many bytes of incoming data all connections together may keep in memory, counting both
+    // messages and receive buffers. Shared by every thread. A message that doesn't fit goes to
+    // disk instead; a receive buffer makes do with the room it has. A message kept in memory stays
+    // counted while it waits in the delivery queue, until it has been delivered or given up on.
 
-          return kj::heapString(all.slice(0, *pos + delimiter.size()));
-        } else {
-          output.add(kj::heapString(line));
-          return readUntilHelper(kj::mv(delimiter), kj::mv(output));
+  public:
+    explicit MemoryBudget(uint64_t limit): limit(limit) {}
+    KJ_DISALLOW_COPY(MemoryBudget);
+
+    bool tryReserve(uint64_t bytes) {
+      uint64_t current = used.load(std::memory_order_relaxed);
+      do {
+        if (current + bytes > limit) {
+          return false;
         }
-      });
+      } while (!used.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+      return true;
     }
 
-    kj::Promise<kj::String> readUntil(kj::String&& delimiter) {
-      kj::Vector<kj::String> output;
-      output.add(kj::mv(lastBuffer));
-      lastBuffer = kj::str("");
-      return readUntilHelper(kj::mv(delimiter), kj::mv(output));
+    void charge(uint64_t bytes) {
+      // Counts `bytes` even if that goes over the limit, for memory that can't be done without.
+      used.fetch_add(bytes, std::memory_order_relaxed);
     }
 
-    kj::Promise<void> start() {
-      return connection->write(STRING_AND_SIZE("220 Sandstorm SMTP Bridge")).then(
-          [this]() {
-            return messageLoop();
-      });
+    void release(uint64_t bytes) {
+      used.fetch_sub(bytes, std::memory_order_relaxed);
     }
 
-    #define SET_HEADER(name, gmimeName) \
-      header = g_mime_object_get_header((GMimeObject*)msg, #gmimeName); \
-      if (header) { \
-        decoded = g_mime_utils_header_decode_text(header); \
-        HEADER_OBJECT.set##name(decoded); \
-        g_free(decoded); \
-      }
+    uint64_t getUsed() { return used.load(std::memory_order_relaxed); }
 
-    #define SET_HEADER_LIST(name, gmimeName) \
-      header = g_mime_object_get_header((GMimeObject*)msg, #gmimeName); \
-      if (header) { \
-        decoded = g_mime_utils_header_decode_text(header); \
-        HEADER_OBJECT.init##name(1); \
-        HEADER_OBJECT.get##name().set(0, decoded); \
-        g_free(decoded); \
-      }
+  private:
+    uint64_t limit;
+    std::atomic<uint64_t> used { 0 };
+  };
 
+  class MemoryCharge {
+    // Bytes counted against a MemoryBudget, given back when this goes away. Moves along with the
+    // memory it stands for, e.g. from a message being received to the queue entry delivering it.
 
-    void setEmailHeader(sandstorm::EmailAddress::Builder&& address, char * val) {
-      kj::String orig = kj::str(val);
-      KJ_IF_MAYBE(pos, orig.findFirst('<')) {
-        address.setName(kj::str(orig.slice(0, *pos)));
-        address.setAddress(kj::str(orig.slice(*pos + 1, orig.size() - 1)));
-      } else {
-        address.setAddress(val);
+  public:
+    MemoryCharge() = default;
+    MemoryCharge(MemoryBudget* budget, uint64_t bytes): budget(budget), bytes(bytes) {}
+    MemoryCharge(MemoryCharge&& other): budget(other.budget), bytes(other.bytes) {
+      other.bytes = 0;
+    }
+    ~MemoryCharge() noexcept(false) { release(); }
+    KJ_DISALLOW_COPY(MemoryCharge);
+
+    MemoryCharge& operator=(MemoryCharge&& other) {
+      release();
+      budget = other.budget;
+      bytes = other.bytes;
+      other.bytes = 0;
+      return *this;
+    }
+
+    uint64_t size() { return bytes; }
+
+  private:
+    MemoryBudget* budget = nullptr;
+    uint64_t bytes = 0;
+
+    void release() {
+      if (budget != nullptr && bytes > 0) {
+        budget->release(bytes);
       }
+      bytes = 0;
     }
+  };
 
-    #define SET_EMAIL_HEADER(name, gmimeName) \
-      header = g_mime_object_get_header((GMimeObject*)msg, #gmimeName); \
-      if (header) { \
-        decoded = g_mime_utils_header_decode_text(header); \
-        setEmailHeader(HEADER_OBJECT.get##name(), decoded); \
-        g_free(decoded); \
+  // Longest command line accepted, counting the CRLF (RFC 5321 section 4.5.3.1.4). Longer ones
+  // are discarded as they arrive and answered with 500.
+  static constexpr size_t MAX_COMMAND_LINE = 512;
+
+  // Reads from the socket start at MIN_READ_SIZE and double every time the peer fills the whole
+  // chunk, so a large DATA transfer settles into a few big reads instead of thousands of small ones.
+  static constexpr size_t MIN_READ_SIZE = 4096;
+  static constexpr size_t MAX_READ_SIZE = 1 << 20;
+
+  class ReceiveBuffer {
+    // Growable buffer holding bytes read from a connection but not yet consumed. Consumed space
+    // at the front is reclaimed by compacting before the buffer is grown. The allocation is
+    // counted against `budget`, if given; when the budget is used up the buffer stops growing
+    // unless it is completely full.
+
+  public:
+    explicit ReceiveBuffer(MemoryBudget* budget = nullptr)
+        : budget(budget), buffer(kj::heapArray<char>(MIN_READ_SIZE)) {
+      if (budget != nullptr) {
+        budget->charge(buffer.size());
       }
+    }
+    KJ_DISALLOW_COPY(ReceiveBuffer);
 
-    #define SET_EMAIL_HEADER_LIST(name, gmimeName) \
-      header = g_mime_object_get_header((GMimeObject*)msg, #gmimeName); \
-      if (header) { \
-        decoded = g_mime_utils_header_decode_text(header); \
-        HEADER_OBJECT.init##name(1); \
-        setEmailHeader(HEADER_OBJECT.get##name()[0], decoded); \
-        g_free(decoded); \
+    ~ReceiveBuffer() noexcept(false) {
+      if (budget != nullptr) {
+        budget->release(buffer.size());
       }
+    }
 
-    kj::String partToString(GMimeObject * part) {
-      const char * encoding = NULL;
+    kj::ArrayPtr<char> pending() { return buffer.slice(start, end); }
 
-      encoding = g_mime_object_get_header((GMimeObject*)part, "Content-Transfer-Encoding");
-      if (encoding != NULL) {
-        auto gmimeEncoding = g_mime_content_encoding_from_string(encoding);
-        if (gmimeEncoding != GMIME_CONTENT_ENCODING_DEFAULT) {
-          return partToString(part, gmimeEncoding);
+    void consume(size_t n) {
+      KJ_ASSERT(n <= end - start);
+      start += n;
+      if (start == end) {
+        start = end = 0;
+      }
+    }
+
+    kj::ArrayPtr<char> reserve(size_t n) {
+      // Returns writable space following the pending data: at least `n` bytes, unless the memory
+      // budget won't allow that much, but never none. Call commit() with the number filled.
+      if (buffer.size() - end >= n) {
+        return buffer.slice(end, buffer.size());
+      }
+      size_t used = end - start;
+      if (buffer.size() - used < n) {
+        size_t newSize = kj::max(buffer.size() * 2, used + n);
+        size_t extra = newSize - buffer.size();
+        if (budget == nullptr || budget->tryReserve(extra)) {
+          reallocate(newSize);
+          return buffer.slice(end, buffer.size());
+        } else if (used == buffer.size()) {
+          budget->charge(extra);
+          reallocate(newSize);
+          return buffer.slice(end, buffer.size());
         }
       }
+      memmove(buffer.begin(), buffer.begin() + start, used);
+      start = 0;
+      end = used;
+      return buffer.slice(end, buffer.size());
+    }
 
-      auto content = g_mime_part_get_content_object((GMimePart *)part);
-      KJ_ASSERT(content != NULL, "Content of message unexpectedly null");
-      auto stream = g_mime_data_wrapper_get_stream(content);
-      auto length = g_mime_stream_length(stream);
-      KJ_ASSERT(length >= 0, "Content's stream has unknown length", length);
-      kj::String ret = kj::heapString(length);
-      uint totalBytes = 0;
-      while (totalBytes < length) {
-        uint readBytes = g_mime_stream_read(stream, ret.begin() + totalBytes, length - totalBytes);
+    void commit(size_t n) {
+      KJ_ASSERT(n <= buffer.size() - end);
+      end += n;
+    }
 
-        KJ_ASSERT(readBytes != -1, "Read failed");
-        if (readBytes == 0) {
-          break;
+    void shrink() {
+      // Gives back what the buffer grew to beyond MIN_READ_SIZE, e.g. once a large message has
+      // been received, as long as the pending data still fits.
+      if (buffer.size() > MIN_READ_SIZE && end - start <= MIN_READ_SIZE) {
+        size_t extra = buffer.size() - MIN_READ_SIZE;
+        reallocate(MIN_READ_SIZE);
+        if (budget != nullptr) {
+          budget->release(extra);
         }
-        totalBytes += readBytes;
       }
+    }
+
+  private:
+    MemoryBudget* budget;
+    kj::Array<char> buffer;
+    size_t start = 0;
+    size_t end = 0;
 
-      return kj::heapString(ret.slice(0, totalBytes));
+    void reallocate(size_t size) {
+      // Moves the pending data to the front of a new `size`-byte buffer.
+      size_t used = end - start;
+      auto newBuffer = kj::heapArray<char>(size);
+      memcpy(newBuffer.begin(), buffer.begin() + start, used);
+      buffer = kj::mv(newBuffer);
+      start = 0;
+      end = used;
     }
+  };
 
-    kj::String partToString(GMimeObject * part, GMimeContentEncoding encoding) {
-      if (encoding == GMIME_CONTENT_ENCODING_DEFAULT) {
-        return partToString(part);
-      }
+  class MessageSink {
+    // Destination for the raw bytes of a message while it is still being received. The sink
+    // collects the message in the form GMime will parse it from, so the message is never held in
+    // an intermediate buffer first.
 
-      auto content = g_mime_part_get_content_object((GMimePart *)part);
-      KJ_ASSERT(content != NULL, "Content of message unexpectedly null");
-      auto stream = g_mime_data_wrapper_get_stream(content);
-      auto filteredStream = g_mime_stream_filter_new(stream);
-      auto filter = g_mime_filter_basic_new(encoding, FALSE);
-      g_mime_stream_filter_add((GMimeStreamFilter *)filteredStream, filter);
-      auto length = g_mime_stream_length(filteredStream);
-      KJ_ASSERT(length >= 0, "Content's stream has unknown length", length);
-      kj::String ret = kj::heapString(length);
-      uint totalBytes = 0;
-      while (totalBytes < length) {
-        uint readBytes = g_mime_stream_read(filteredStream, ret.begin() + totalBytes, length - totalBytes);
+  public:
+    virtual ~MessageSink() noexcept(false) {}
 
-        KJ_ASSERT(readBytes != -1, "Read failed");
-        if (readBytes == 0) {
-          break;
-        }
-        totalBytes += readBytes;
+    virtual void write(kj::ArrayPtr<const char> data) = 0;
+
+    virtual kj::ArrayPtr<char> prepareWrite(size_t size) = 0;
+    virtual void commitWrite(size_t size) = 0;
+    // Lets the caller append up to `size` bytes by filling the returned space directly, e.g.
+    // from a socket read, instead of going through write(). commitWrite() says how many bytes
+    // were actually filled.
+
+    virtual uint64_t size() = 0;
+    // Bytes written so far.
+
+    virtual kj::ArrayPtr<const char> getContents() = 0;
+    // Everything written so far, in place.
+
+    virtual GMimeMessage* parse() = 0;
+    // Parses everything written so far. The caller owns the returned reference.
+
+    virtual MemoryCharge takeCharge() { return MemoryCharge(); }
+    // Hands over whatever the sink has counted against the memory budget. A message parsed from
+    // an in-memory sink keeps the sink's buffer alive, so the charge should go with the message.
+  };
+
+  class MemoryMessageSink final: public MessageSink {
+    // Appends the message to a GMime memory stream, which the parser then reads in place.
+
+  public:
+    MemoryMessageSink(): stream(g_mime_stream_mem_new()) {}
+    ~MemoryMessageSink() noexcept(false) { g_object_unref(stream); }
+    KJ_DISALLOW_COPY(MemoryMessageSink);
+
+    void write(kj::ArrayPtr<const char> data) override {
+      if (data.size() > 0) {
+        KJ_ASSERT(g_mime_stream_write(stream, data.begin(), data.size()) == (ssize_t)data.size());
       }
+    }
 
-      g_object_unref (filteredStream);
-      g_object_unref (filter);
-      return kj::heapString(ret.slice(0, totalBytes));
+    kj::ArrayPtr<char> prepareWrite(size_t size) override {
+      GByteArray* bytes = g_mime_stream_mem_get_byte_array((GMimeStreamMem*)stream);
+      reservedFrom = bytes->len;
+      g_byte_array_set_size(bytes, reservedFrom + size);
+      return kj::arrayPtr(reinterpret_cast<char*>(bytes->data) + reservedFrom, size);
     }
 
-    struct Email {
-      kj::String text;
-      kj::String html;
-      capnp::MallocMessageBuilder message;
-      kj::Vector<capnp::Orphan<EmailAttachment>> attachments;
-    };
+    void commitWrite(size_t size) override {
+      GByteArray* bytes = g_mime_stream_mem_get_byte_array((GMimeStreamMem*)stream);
+      g_byte_array_set_size(bytes, reservedFrom + size);
+      // Keep the stream's position at the end so later write()s append.
+      g_mime_stream_seek(stream, 0, GMIME_STREAM_SEEK_END);
+    }
 
-    void addAttachment(Email& email, GMimeObject * part) {
-      auto msg = part;
-      const char * header;
-      char * decoded;
+    uint64_t size() override {
+      return g_mime_stream_mem_get_byte_array((GMimeStreamMem*)stream)->len;
+    }
 
-      email.attachments.add(email.message.getOrphanage().newOrphan<EmailAttachment>());
-      auto attachment = email.attachments.back().get();
-      auto str = partToString(part);
-      kj::ArrayPtr<const capnp::byte> data(reinterpret_cast<const capnp::byte *>(str.begin()), str.size());
+    kj::ArrayPtr<const char> getContents() override {
+      GByteArray* bytes = g_mime_stream_mem_get_byte_array((GMimeStreamMem*)stream);
+      return kj::arrayPtr(reinterpret_cast<const char*>(bytes->data), bytes->len);
+    }
 
-      attachment.setContent(data);
-      #define HEADER_OBJECT attachment
-      SET_HEADER(ContentType, Content-Type)
-      SET_HEADER(ContentDisposition, Content-Disposition)
-      SET_HEADER(ContentId, Content-Id)
+    GMimeMessage* parse() override {
+      g_mime_stream_reset(stream);
+      return parse_message(stream);
+    }
 
-      header = g_mime_object_get_header((GMimeObject*)msg, "Content-Id");
-      if (header) {
-        decoded = g_mime_utils_header_decode_text(header);
-        auto tmp = kj::str(decoded);
-        auto trimmed = trim(trim(tmp, '<'), '>');
-        HEADER_OBJECT.setContentId(kj::str(trimmed));
-        g_free(decoded);
+  private:
+    GMimeStream* stream;
+    size_t reservedFrom = 0;
+  };
+
+  struct ReceiveOptions {
+    uint64_t maxMessageSize = 64ull << 20;
+    // Advertised with the SIZE extension. Larger messages are refused with 552.
+
+    uint64_t spillThreshold = 1ull << 20;
+    // A message that grows past this many bytes is moved from memory to a temporary file.
+
+    kj::StringPtr spillDirectory = "/tmp";
+    // Where temporary files are created. They are unlinked from the start.
+
+    MemoryBudget* memoryBudget = nullptr;
+    // If set, receive buffers are counted against it, and messages are also moved to disk
+    // whenever keeping them in memory would exceed it. Messages held in memory stay counted until
+    // delivered.
+
+    kj::Duration commandTimeout = 5 * kj::MINUTES;
+    // How long a client may take to send each command, or to take each batch of replies off our
+    // hands. RFC 5321 §4.5.3.2 asks for at least five minutes.
+
+    kj::Duration dataTimeout = 3 * kj::MINUTES;
+    uint64_t minDataRate = 1024;
+    // A DATA section or BDAT chunk may take `dataTimeout`, plus one second for every
+    // `minDataRate` bytes received so far. A client that stalls, or trickles the message in
+    // slower than that, is cut off with 421.
+
+    uint maxConnections = 1000;
+    // Sessions served at once. Beyond this, connections are left in the kernel's listen backlog
+    // until one finishes. 0 means no limit.
+
+    uint maxConnectionsPerAddress = 0;
+    // Sessions served at once for one client address. Further connections from it get 421 and
+    // are closed. 0 means no limit.
+
+    kj::StringPtr captureDirectory;
+    // If not empty, everything each client sends is recorded to a new SessionCapture file here.
+  };
+
+  int openUnlinkedFile(kj::StringPtr directory) {
+    // Returns a read-write descriptor for a new file in `directory` that has no name.
+    int fd = open(directory.cStr(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      return fd;
+    }
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+      KJ_FAIL_SYSCALL("open(O_TMPFILE)", errno, directory);
+    }
+    // Kernel or filesystem without O_TMPFILE.
+    auto path = kj::str(directory, "/sandstorm-smtp-XXXXXX");
+    KJ_SYSCALL(fd = mkostemp(path.begin(), O_CLOEXEC), directory);
+    KJ_SYSCALL(unlink(path.cStr()));
+    return fd;
+  }
+
+  class SpillingMessageSink final: public MessageSink {
+    // Collects a message in memory, like MemoryMessageSink, until it grows past the spill
+    // threshold or the memory budget runs out. Then it moves the message to an unlinked temporary
+    // file and keeps appending there. A spilled message is parsed through an mmap()ed stream, so
+    // however large it is, only the pages being looked at take up memory. Bytes beyond the
+    // maximum message size are dropped and the sink remembers it was too large.
+    //
+    // Writes to the file are plain blocking write()s on the connection's thread, so every other
+    // session on that event loop waits while they complete. The spill directory should be on
+    // fast local storage.
+
+  public:
+    explicit SpillingMessageSink(const ReceiveOptions& options)
+        : options(options), memory(kj::heap<MemoryMessageSink>()) {}
+
+    ~SpillingMessageSink() noexcept(false) {
+      releaseCharge(charged);
+      if (mapping != nullptr) {
+        munmap(mapping, mappingSize);
       }
-      #undef HEADER_OBJECT
     }
 
-    void setBody(Email& email, GMimeObject * part, bool isTopLevel) {
-      auto type = g_mime_object_get_content_type(part);
-      if (!type) {
-        if (isTopLevel) {
-          email.text = partToString(part);
-        } else {
-          KJ_FAIL_ASSERT("Unhandled mime part with unkown type");
-        }
+    KJ_DISALLOW_COPY(SpillingMessageSink);
+
+    bool isTooLarge() { return tooLarge; }
+    bool isSpilled() { return memory.get() == nullptr; }
+
+    void write(kj::ArrayPtr<const char> data) override {
+      if (data.size() == 0 || tooLarge) {
+        return;
+      }
+      if (size() + data.size() > options.maxMessageSize) {
+        tooLarge = true;
+        return;
+      }
+      makeRoom(data.size());
+      if (isSpilled()) {
+        kj::FdOutputStream(file.get()).write(data.begin(), data.size());
+        fileSize += data.size();
       } else {
-        if (g_mime_object_get_disposition(part) != NULL) {
-            addAttachment(email, part);
-        } else if (g_mime_content_type_is_type(type, "text", "*")) {
-          if (g_mime_content_type_is_type(type, "text", "html")) {
-            email.html = partToString(part);
-          } else {
-            email.text = partToString(part);
-          }
-        } else if (GMIME_IS_MULTIPART(part)) {
-          GMimeMultipart * multipart = (GMimeMultipart *)part;
-          int numParts = g_mime_multipart_get_count(multipart);
+        memory->write(data);
+      }
+    }
 
-          for(int i = 0; i < numParts; ++i) {
-            auto subPart = g_mime_multipart_get_part(multipart, i);
-            setBody(email, subPart, false);
-          }
-        } else {
-          KJ_FAIL_ASSERT("Unhandled mime part", g_mime_content_type_to_string(type));
+    kj::ArrayPtr<char> prepareWrite(size_t size) override {
+      KJ_REQUIRE(this->size() + size <= options.maxMessageSize, "write would exceed the size limit");
+      makeRoom(size);
+      prepared = size;
+      if (isSpilled()) {
+        if (staging.size() < size) {
+          staging = kj::heapArray<char>(size);
         }
+        return staging.slice(0, size);
       }
+      return memory->prepareWrite(size);
     }
-    kj::Promise<void> forwardMessage(kj::StringPtr data) {
-      auto req = emailCap.sendRequest();
-      auto msg = parse_message(data);
-      auto email = req.getEmail();
-      auto part = g_mime_message_get_mime_part(msg);
-      const char * header;
-      char * decoded;
 
-      KJ_REQUIRE(GMIME_IS_OBJECT(msg), "Message was unable to parsed as a valid MIME object");
-      #define HEADER_OBJECT email
-      SET_EMAIL_HEADER_LIST(To, To);
-      SET_EMAIL_HEADER(From, From);
-      SET_EMAIL_HEADER(ReplyTo, Reply-To);
-      SET_EMAIL_HEADER_LIST(Cc, Cc);
-      SET_EMAIL_HEADER_LIST(Bcc, Bcc);
-      SET_HEADER(Subject, Subject);
-
-      SET_HEADER(MessageId, Message-Id);
-      SET_HEADER_LIST(References, References);
-      SET_HEADER_LIST(InReplyTo, In-Reply-To);
-      #undef HEADER_OBJECT
+    void commitWrite(size_t size) override {
+      KJ_REQUIRE(size <= prepared);
+      if (isSpilled()) {
+        kj::FdOutputStream(file.get()).write(staging.begin(), size);
+        fileSize += size;
+      } else {
+        memory->commitWrite(size);
+        releaseCharge(prepared - size);
+      }
+      prepared = 0;
+    }
 
-      // TODO: parse data
-      struct timeval tv;
-      gettimeofday(&tv,NULL);
-      email.setDate(tv.tv_sec*(uint64_t)1000000000+tv.tv_usec*1000);
+    uint64_t size() override {
+      return isSpilled() ? fileSize : memory->size();
+    }
 
-      if (!part) {
-        // Fail?
-        KJ_SYSCALL(write(STDERR_FILENO, STRING_AND_SIZE("sandstorm-smtp-bridge: Mime part of email wan't found?")));
-        auto objStr = g_mime_object_to_string((GMimeObject*)msg);
-        email.setText(objStr);
-        g_free(objStr);
-      } else {
-        Email tmpEmail;
-        setBody(tmpEmail, part, true);
-        if (tmpEmail.text.size() > 0) {
-          email.setText(tmpEmail.text);
-        }
-        if (tmpEmail.html.size() > 0) {
-          email.setHtml(tmpEmail.html);
+    kj::ArrayPtr<const char> getContents() override {
+      if (!isSpilled()) {
+        return memory->getContents();
+      }
+      if (fileSize == 0) {
+        return nullptr;
+      }
+      if (mapping == nullptr || mappingSize != fileSize) {
+        if (mapping != nullptr) {
+          munmap(mapping, mappingSize);
         }
-
-        auto attachments = email.initAttachments(tmpEmail.attachments.size());
-        for (size_t i = 0; i < tmpEmail.attachments.size(); ++i) {
-          attachments.setWithCaveats(i, tmpEmail.attachments[i].getReader());
+        void* map = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, file.get(), 0);
+        if (map == MAP_FAILED) {
+          mapping = nullptr;
+          KJ_FAIL_SYSCALL("mmap", errno);
         }
+        mapping = map;
+        mappingSize = fileSize;
       }
+      return kj::arrayPtr(reinterpret_cast<const char*>(mapping), fileSize);
+    }
 
-      g_object_unref(msg);
-
-      return req.send().then([](auto results) {});
+    MemoryCharge takeCharge() override {
+      MemoryCharge result(options.memoryBudget, charged);
+      charged = 0;
+      return result;
     }
 
-    kj::Promise<bool> handleCommand(kj::String&& line) {
-      kj::ArrayPtr<const char> rawCommand = line.slice(0, line.size() - 2); // Chop off line ending
-      KJ_IF_MAYBE(pos, line.findFirst(' ')) {
-        rawCommand = rawCommand.slice(0, *pos);
+    GMimeMessage* parse() override {
+      if (!isSpilled()) {
+        return memory->parse();
       }
 
-      auto command = kj::heapString(rawCommand);
-      toLower(command);
-      if (command == "helo") {
-        // TODO(someday): make sure hostname is passed as an argument
-        return connection->write(STRING_AND_SIZE("250 Sandstorm at your service")).then([]() {
-          return true;
-        });
-      } else if (command == "mail") {
-        // TODO(someday): do something here?
-        return connection->write(STRING_AND_SIZE("250 OK")).then([]() {
-          return true;
-        });
-      } else if (command == "data") {
-        return connection->write(STRING_AND_SIZE("354 Start mail input; end with <CRLF>.<CRLF>")).then([&]() {
-          return readUntil(kj::str(END_BODY));
-        }).then([&](auto data) {
-          return forwardMessage(data);
-        }).then([&]() {
-            connection->write(STRING_AND_SIZE("250 OK"));
-        }).then([]() {
-          return true;
-        });
-      } else if (command == "rcpt") {
-        // TODO(someday): do something here?
-        return connection->write(STRING_AND_SIZE("250 OK")).then([]() {
-          return true;
-        });
-      } else if (command == "noop") {
-        return connection->write(STRING_AND_SIZE("250 OK")).then([]() {
-          return true;
-        });
-      } else if (command == "rset") {
-        return connection->write(STRING_AND_SIZE("250 OK")).then([]() {
-          return true;
-        });
-      } else if (command == "quit") {
-        return connection->write(STRING_AND_SIZE("221 2.0.0 Goodbye!")).then([]() {
-          return false;
-        });
-      } else {
-        return connection->write(STRING_AND_SIZE("502 5.5.2 Error: command not recognized")).then([]() {
-          return true;
-        });
+      // The stream takes over its own descriptor, positioned where the message starts.
+      int fd;
+      KJ_SYSCALL(fd = fcntl(file.get(), F_DUPFD_CLOEXEC, 0));
+      KJ_SYSCALL(lseek(fd, 0, SEEK_SET));
+      GMimeStream* stream = g_mime_stream_mmap_new(fd, PROT_READ, MAP_PRIVATE);
+      if (stream == nullptr) {
+        close(fd);
+        KJ_FAIL_REQUIRE("couldn't map spilled message");
       }
+      GMimeMessage* message = parse_message(stream);
+      g_object_unref(stream);
+      return message;
     }
 
-    kj::Promise<void> messageLoop() {
-      return readUntil(kj::str(END_LINE)).then(
-          [this](kj::String&& line) -> kj::Promise<void> {
-        if (line.size() == 0) {
-          return kj::READY_NOW;
+  private:
+    const ReceiveOptions& options;
+    kj::Own<MemoryMessageSink> memory;  // null once spilled
+    kj::AutoCloseFd file;
+    uint64_t fileSize = 0;
+    uint64_t charged = 0;  // bytes of `memory` counted against the budget
+    size_t prepared = 0;
+    kj::Array<char> staging;
+    void* mapping = nullptr;
+    size_t mappingSize = 0;
+    bool tooLarge = false;
+
+    void makeRoom(size_t bytes) {
+      // Ensures `bytes` more can be held, spilling to disk first if memory is not the place.
+      if (isSpilled()) {
+        return;
+      }
+      if (memory->size() + bytes > options.spillThreshold) {
+        spill();
+        return;
+      }
+      if (options.memoryBudget != nullptr) {
+        if (!options.memoryBudget->tryReserve(bytes)) {
+          spill();
+          return;
         }
-        return handleCommand(kj::mv(line)).then([&](bool continueLoop) -> kj::Promise<void> {
-          if (continueLoop) {
-            return messageLoop();
-          } else {
-            return kj::READY_NOW;
-          }
-        });
-      },
-          [this](kj::Exception&& err) {
-            KJ_LOG(ERROR, err);
-        return kj::READY_NOW;
-        // Swallow exception and quit looping server
-      });
+        charged += bytes;
+      }
     }
-  };
 
-  kj::Promise<void> runServer(kj::ConnectionReceiver& serverPort,
-                               kj::TaskSet& taskSet, EmailSendPort::Client& emailCap) {
-    return serverPort.accept().then([&](kj::Own<kj::AsyncIoStream>&& connection) {
-      auto connectionState = kj::heap<AcceptedConnection>(kj::mv(connection), emailCap);
-      auto promise = connectionState->start();
-      taskSet.add(promise.attach(kj::mv(connectionState)));
-      return runServer(serverPort, taskSet, emailCap);
-    });
-  }
+    void releaseCharge(uint64_t bytes) {
+      if (options.memoryBudget != nullptr && bytes > 0) {
+        options.memoryBudget->release(bytes);
+        charged -= bytes;
+      }
+    }
+
+    void spill() {
+      file = kj::AutoCloseFd(openUnlinkedFile(options.spillDirectory));
+      auto contents = memory->getContents();
+      kj::FdOutputStream(file.get()).write(contents.begin(), contents.size());
+      fileSize = contents.size();
+      memory = nullptr;
+      releaseCharge(charged);
+    }
+  };
+
+  class DotUnstuffer {
+    // Incrementally decodes an RFC 5321 DATA section: strips the leading '.' from stuffed lines
+    // and stops at the <CRLF>.<CRLF> terminator. Every input byte is looked at exactly once;
+    // decoding happens in place in the receive buffer and each decoded run is handed to the sink
+    // in one write.
+
+  public:
+    DotUnstuffer() = default;
+
+    void reset(MessageSink& newSink) {
+      // Starts decoding a new DATA section into `newSink`. Lets a connection keep one decoder for
+      // all of its messages.
+      sink = &newSink;
+      state = LINE_START;
+    }
+
+    size_t feed(kj::ArrayPtr<char> input) {
+      // Consumes bytes from `input` and returns how many were used. Stops right after the
+      // terminator, leaving any pipelined bytes that follow it unconsumed. `input` is scratch
+      // space afterwards.
+      char* flushStart = input.begin();  // start of decoded output not yet given to the sink
+      char* out = input.begin();
+      char* pos = input.begin();
+      char* end = input.end();
+      while (pos < end && state != DONE) {
+        if (state == MIDDLE) {
+          char* cr = reinterpret_cast<char*>(memchr(pos, '\r', end - pos));
+          char* runEnd = cr == nullptr ? end : cr + 1;
+          if (out != pos) {
+            memmove(out, pos, runEnd - pos);
+          }
+          out += runEnd - pos;
+          pos = runEnd;
+          if (cr != nullptr) {
+            state = CR;
+          }
+          continue;
+        }
+
+        char c = *pos++;
+        switch (state) {
+          case LINE_START:
+            if (c == '.') {
+              state = DOT;
+            } else {
+              *out++ = c;
+              state = c == '\r' ? CR : MIDDLE;
+            }
+            break;
+          case CR:
+            *out++ = c;
+            state = c == '\n' ? LINE_START : c == '\r' ? CR : MIDDLE;
+            break;
+          case DOT:
+            if (c == '\r') {
+              state = DOT_CR;
+            } else {
+              *out++ = c;
+              state = MIDDLE;
+            }
+            break;
+          case DOT_CR:
+            if (c == '\n') {
+              state = DONE;
+            } else {
+              // A stuffed line whose CR was not followed by LF. The CR may have arrived in an
+              // earlier read, so emit it directly rather than into the in-place output. Output
+              // then carries on in place from `c`, which is already where it belongs.
+              sink->write(kj::arrayPtr(flushStart, out));
+              sink->write(kj::arrayPtr("\r", 1));
+              flushStart = pos - 1;
+              out = pos;
+              state = c == '\r' ? CR : MIDDLE;
+            }
+            break;
+          case MIDDLE:
+          case DONE:
+            KJ_UNREACHABLE;
+        }
+      }
+      sink->write(kj::arrayPtr(flushStart, out));
+      return pos - input.begin();
+    }
+
+    bool isDone() { return state == DONE; }
+
+  private:
+    enum State {
+      LINE_START,
+      MIDDLE,
+      CR,
+      DOT,
+      DOT_CR,
+      DONE
+    };
+
+    MessageSink* sink = nullptr;
+    State state = LINE_START;
+  };
+
+  class GObjectDisposer final: public kj::Disposer {
+    // Lets a kj::Own hold a GObject reference.
+
+  public:
+    static GObjectDisposer instance;
+
+    void disposeImpl(void* pointer) const override {
+      g_object_unref(pointer);
+    }
+  };
+
+  GObjectDisposer GObjectDisposer::instance;
+
+  template <typename T>
+  kj::Own<T> ownGObject(T* object) {
+    // Takes over the caller's reference to `object`.
+    return kj::Own<T>(object, GObjectDisposer::instance);
+  }
+
+  static const size_t PARALLEL_DECODE_THRESHOLD = 256 << 10;
+  // Encoded attachments at least this big are decoded on the DecodePool, if there is one.
+
+  static const size_t TRANSLATOR_SCRATCH_SIZE = 16384;
+  // Enough for the unfolded and decoded headers of all but unusual messages.
+
+  struct EmailTranslator {
+    // Fills in an EmailMessage from a parsed MIME message. Per-message temporaries come from an
+    // arena over `scratch`, which the caller keeps from one message to the next; only messages
+    // that outgrow it make the arena allocate.
+
+    explicit EmailTranslator(DecodeClient* decoder = nullptr,
+                             kj::ArrayPtr<kj::byte> scratch = nullptr)
+        : decoder(decoder), arena(scratch) {}
+
+    DecodeClient* decoder;
+    kj::Arena arena;
+
+    #define SET_HEADER(name, gmimeName) \
+      header = g_mime_object_get_header((GMimeObject*)msg, #gmimeName); \
+      if (header) { \
+        decoded = g_mime_utils_header_decode_text(header); \
+        HEADER_OBJECT.set##name(decoded); \
+        g_free(decoded); \
+      }
+
+    static capnp::Text::Reader asText(kj::ArrayPtr<const char> text) {
+      return capnp::Text::Reader(text.begin(), text.size());
+    }
+
+    kj::ArrayPtr<const char> unfoldValue(const headers::Field& field) {
+      // Only folded values are copied into the arena; the rest point into the message.
+      size_t size = field.valueSize;
+      char* scratch = nullptr;
+      if (memchr(field.value, '\n', size) != nullptr) {
+        scratch = arena.allocateArray<char>(size).begin();
+      }
+      const char* value = headers::unfold(field.value, size, scratch);
+      return kj::arrayPtr(value, size);
+    }
+
+    template <typename Func>
+    void withDecodedText(kj::ArrayPtr<const char> text, Func&& func) {
+      // Calls func(text) after RFC 2047 decoding. Plain ASCII text is passed through untouched.
+      if (!headers::needsDecoding(text.begin(), text.size())) {
+        func(asText(text));
+        return;
+      }
+      auto copy = arena.allocateArray<char>(text.size() + 1);
+      memcpy(copy.begin(), text.begin(), text.size());
+      copy[text.size()] = '\0';
+      char * decoded = g_mime_utils_header_decode_text(copy.begin());
+      KJ_DEFER(g_free(decoded));
+      func(capnp::Text::Reader(decoded));
+    }
+
+    void setAddress(sandstorm::EmailAddress::Builder address,
+                    const char* name, size_t nameSize, const char* addr, size_t addrSize) {
+      if (nameSize > 0) {
+        withDecodedText(kj::arrayPtr(name, nameSize), [&](capnp::Text::Reader text) {
+          address.setName(text);
+        });
+      }
+      address.setAddress(asText(kj::arrayPtr(addr, addrSize)));
+    }
+
+    void setAddress(sandstorm::EmailAddress::Builder address, kj::ArrayPtr<const char> value) {
+      // Uses the first mailbox in `value`. If there is none, as with "undisclosed-recipients:;"
+      // or a malformed header, the whole value becomes the address rather than being dropped.
+      bool done = false;
+      headers::parseAddressList(value.begin(), value.size(),
+          [&](const char* name, size_t nameSize, const char* addr, size_t addrSize) {
+        if (!done) {
+          setAddress(address, name, nameSize, addr, addrSize);
+          done = true;
+        }
+      });
+      if (!done) {
+        withDecodedText(value, [&](capnp::Text::Reader text) {
+          address.setAddress(text);
+        });
+      }
+    }
+
+    template <typename InitFunc>
+    void setAddressList(kj::ArrayPtr<const char> value, InitFunc&& init) {
+      // Counts the mailboxes in `value`, calls init(count) for the list, and fills it in.
+      uint count = 0;
+      headers::parseAddressList(value.begin(), value.size(),
+          [&](const char*, size_t, const char*, size_t) { ++count; });
+      auto list = init(count);
+      uint i = 0;
+      headers::parseAddressList(value.begin(), value.size(),
+          [&](const char* name, size_t nameSize, const char* addr, size_t addrSize) {
+        setAddress(list[i++], name, nameSize, addr, addrSize);
+      });
+    }
+
+    void setHeaders(sandstorm::EmailMessage::Builder email, kj::ArrayPtr<const char> raw) {
+      // Fills in the top-level headers from the raw message in one pass. As with GMime's lookup,
+      // the first occurrence of a field wins.
+      headers::FieldReader reader(raw.begin(), raw.size());
+      headers::Field field;
+      while (reader.next(field)) {
+        if (headers::nameIs(field, "To")) {
+          if (!email.hasTo()) {
+            setAddressList(unfoldValue(field), [&](uint n) { return email.initTo(n); });
+          }
+        } else if (headers::nameIs(field, "Cc")) {
+          if (!email.hasCc()) {
+            setAddressList(unfoldValue(field), [&](uint n) { return email.initCc(n); });
+          }
+        } else if (headers::nameIs(field, "Bcc")) {
+          if (!email.hasBcc()) {
+            setAddressList(unfoldValue(field), [&](uint n) { return email.initBcc(n); });
+          }
+        } else if (headers::nameIs(field, "From")) {
+          if (!email.hasFrom()) {
+            setAddress(email.initFrom(), unfoldValue(field));
+          }
+        } else if (headers::nameIs(field, "Reply-To")) {
+          if (!email.hasReplyTo()) {
+            setAddress(email.initReplyTo(), unfoldValue(field));
+          }
+        } else if (headers::nameIs(field, "Subject")) {
+          if (!email.hasSubject()) {
+            withDecodedText(unfoldValue(field), [&](capnp::Text::Reader text) {
+              email.setSubject(text);
+            });
+          }
+        } else if (headers::nameIs(field, "Message-Id")) {
+          if (!email.hasMessageId()) {
+            withDecodedText(unfoldValue(field), [&](capnp::Text::Reader text) {
+              email.setMessageId(text);
+            });
+          }
+        } else if (headers::nameIs(field, "References")) {
+          if (!email.hasReferences()) {
+            withDecodedText(unfoldValue(field), [&](capnp::Text::Reader text) {
+              email.initReferences(1).set(0, text);
+            });
+          }
+        } else if (headers::nameIs(field, "In-Reply-To")) {
+          if (!email.hasInReplyTo()) {
+            withDecodedText(unfoldValue(field), [&](capnp::Text::Reader text) {
+              email.initInReplyTo(1).set(0, text);
+            });
+          }
+        }
+      }
+    }
+
+    kj::Maybe<kj::ArrayPtr<const char>> rawMessageContents(GMimeMessage* msg) {
+      // The bytes `msg` was parsed from, if parse_message() kept a memory- or mmap-backed stream.
+      auto stream = static_cast<GMimeStream *>(g_object_get_data(G_OBJECT(msg), RAW_STREAM_KEY));
+      if (stream == nullptr) {
+        return nullptr;
+      }
+      KJ_IF_MAYBE(raw, rawStreamContents(stream)) {
+        return kj::arrayPtr(reinterpret_cast<const char *>(raw->begin()), raw->size());
+      }
+      return nullptr;
+    }
+
+    static kj::ArrayPtr<capnp::byte> asBytes(capnp::Text::Builder text) { return text.asBytes(); }
+    static kj::ArrayPtr<capnp::byte> asBytes(capnp::Data::Builder data) { return data; }
+
+    size_t readStream(GMimeStream * stream, kj::ArrayPtr<capnp::byte> buffer) {
+      size_t totalBytes = 0;
+      while (totalBytes < buffer.size()) {
+        ssize_t readBytes = g_mime_stream_read(stream, reinterpret_cast<char*>(buffer.begin()) + totalBytes,
+                                               buffer.size() - totalBytes);
+
+        KJ_ASSERT(readBytes != -1, "Read failed");
+        if (readBytes == 0) {
+          break;
+        }
+        totalBytes += readBytes;
+      }
+      return totalBytes;
+    }
+
+    template <typename T>
+    capnp::Orphan<T> decodeStream(capnp::Orphanage orphanage, GMimeStream * stream) {
+      // Decodes straight into a new Text or Data blob allocated in the message that owns
+      // `orphanage`. The stream's length is an upper bound on the decoded size; the blob is
+      // truncated to fit afterwards.
+      auto length = g_mime_stream_length(stream);
+      KJ_ASSERT(length >= 0, "Content's stream has unknown length", length);
+      auto result = orphanage.newOrphan<T>(length);
+      size_t totalBytes = readStream(stream, asBytes(result.get()));
+      result.truncate(totalBytes);
+      return result;
+    }
+
+    kj::Maybe<kj::ArrayPtr<const capnp::byte>> rawStreamContents(GMimeStream * stream) {
+      // Returns the bytes behind a memory- or mmap-backed stream without copying them, or null if
+      // the stream is neither. Part content parsed with a persistent stream is such a substream.
+      if (GMIME_IS_STREAM_MEM(stream)) {
+        GByteArray * bytes = g_mime_stream_mem_get_byte_array((GMimeStreamMem *)stream);
+        const capnp::byte * data = bytes->data;
+        gint64 end = stream->bound_end == -1 ? (gint64)bytes->len : stream->bound_end;
+        return kj::arrayPtr(data + stream->bound_start, data + end);
+      } else if (GMIME_IS_STREAM_MMAP(stream)) {
+        GMimeStreamMmap * mapped = (GMimeStreamMmap *)stream;
+        const capnp::byte * data = reinterpret_cast<const capnp::byte *>(mapped->map);
+        gint64 end = stream->bound_end == -1 ? (gint64)mapped->maplen : stream->bound_end;
+        return kj::arrayPtr(data + stream->bound_start, data + end);
+      }
+      return nullptr;
+    }
+
+    static size_t decodedSizeBound(kj::ArrayPtr<const capnp::byte> raw, GMimeContentEncoding encoding) {
+      return encoding == GMIME_CONTENT_ENCODING_BASE64
+          ? decode::base64DecodedSizeBound(raw.size())
+          : decode::quotedPrintableDecodedSizeBound(raw.size());
+    }
+
+    static size_t decodeInto(kj::ArrayPtr<const capnp::byte> raw, GMimeContentEncoding encoding,
+                             kj::ArrayPtr<capnp::byte> out) {
+      // Decodes base64 or quoted-printable `raw` into `out`, which must hold decodedSizeBound()
+      // bytes, and returns the decoded size. Touches nothing else, so it is safe on any thread.
+      return encoding == GMIME_CONTENT_ENCODING_BASE64
+          ? decode::decodeBase64(raw.begin(), raw.size(), out.begin(), out.size())
+          : decode::decodeQuotedPrintable(raw.begin(), raw.size(), out.begin());
+    }
+
+    template <typename T>
+    capnp::Orphan<T> decodeRaw(capnp::Orphanage orphanage, kj::ArrayPtr<const capnp::byte> raw,
+                               GMimeContentEncoding encoding) {
+      // Decodes base64 or quoted-printable content in a single pass into a blob in the message
+      // that owns `orphanage`.
+      auto result = orphanage.newOrphan<T>(decodedSizeBound(raw, encoding));
+      result.truncate(decodeInto(raw, encoding, asBytes(result.get())));
+      return result;
+    }
+
+    kj::Maybe<kj::ArrayPtr<const capnp::byte>> rawEncodedContent(GMimeObject * part,
+                                                                 GMimeContentEncoding& encoding) {
+      // The undecoded bytes of a base64 or quoted-printable part, if they can be had without
+      // copying. Sets `encoding`.
+      const char * header = g_mime_object_get_header(part, "Content-Transfer-Encoding");
+      if (header == NULL || !GMIME_IS_PART(part)) {
+        return nullptr;
+      }
+      encoding = g_mime_content_encoding_from_string(header);
+      if (encoding != GMIME_CONTENT_ENCODING_BASE64 && encoding != GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE) {
+        return nullptr;
+      }
+      auto content = g_mime_part_get_content_object((GMimePart *)part);
+      if (content == NULL) {
+        return nullptr;
+      }
+      return rawStreamContents(g_mime_data_wrapper_get_stream(content));
+    }
+
+    template <typename T>
+    capnp::Orphan<T> decodePart(capnp::Orphanage orphanage, GMimeObject * part) {
+      const char * encoding = NULL;
+
+      encoding = g_mime_object_get_header((GMimeObject*)part, "Content-Transfer-Encoding");
+      if (encoding != NULL) {
+        auto gmimeEncoding = g_mime_content_encoding_from_string(encoding);
+        if (gmimeEncoding != GMIME_CONTENT_ENCODING_DEFAULT) {
+          return decodePart<T>(orphanage, part, gmimeEncoding);
+        }
+      }
+
+      auto content = g_mime_part_get_content_object((GMimePart *)part);
+      KJ_ASSERT(content != NULL, "Content of message unexpectedly null");
+      auto stream = g_mime_data_wrapper_get_stream(content);
+      return decodeStream<T>(orphanage, stream);
+    }
+
+    template <typename T>
+    capnp::Orphan<T> decodePart(capnp::Orphanage orphanage, GMimeObject * part, GMimeContentEncoding encoding) {
+      if (encoding == GMIME_CONTENT_ENCODING_DEFAULT) {
+        return decodePart<T>(orphanage, part);
+      }
+
+      auto content = g_mime_part_get_content_object((GMimePart *)part);
+      KJ_ASSERT(content != NULL, "Content of message unexpectedly null");
+      auto stream = g_mime_data_wrapper_get_stream(content);
+      if (encoding == GMIME_CONTENT_ENCODING_BASE64 || encoding == GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE) {
+        KJ_IF_MAYBE(raw, rawStreamContents(stream)) {
+          return decodeRaw<T>(orphanage, *raw, encoding);
+        }
+      }
+
+      auto filteredStream = g_mime_stream_filter_new(stream);
+      auto filter = g_mime_filter_basic_new(encoding, FALSE);
+      g_mime_stream_filter_add((GMimeStreamFilter *)filteredStream, filter);
+      KJ_DEFER(g_object_unref(filteredStream); g_object_unref(filter));
+      return decodeStream<T>(orphanage, filteredStream);
+    }
+
+    struct MessageParts {
+      // The MIME parts that become the outgoing Email's body and attachments. Walking the tree
+      // first lets the attachment list be allocated at its final size before anything is decoded.
+      GMimeObject * text = nullptr;
+      GMimeObject * html = nullptr;
+      kj::Vector<GMimeObject *> attachments;
+    };
+
+    void addAttachment(sandstorm::EmailAttachment::Builder attachment, GMimeObject * part) {
+      auto content = decodePart<capnp::Data>(capnp::Orphanage::getForMessageContaining(attachment), part);
+      attachment.adoptContent(kj::mv(content));
+      setAttachmentHeaders(attachment, part);
+    }
+
+    void setAttachmentHeaders(sandstorm::EmailAttachment::Builder attachment, GMimeObject * part) {
+      auto msg = part;
+      const char * header;
+      char * decoded;
+
+      #define HEADER_OBJECT attachment
+      SET_HEADER(ContentType, Content-Type)
+      SET_HEADER(ContentDisposition, Content-Disposition)
+      SET_HEADER(ContentId, Content-Id)
+
+      header = g_mime_object_get_header((GMimeObject*)msg, "Content-Id");
+      if (header) {
+        decoded = g_mime_utils_header_decode_text(header);
+        auto trimmed = trim(trim(kj::arrayPtr(decoded, strlen(decoded)), '<'), '>');
+        HEADER_OBJECT.setContentId(asText(trimmed));
+        g_free(decoded);
+      }
+      #undef HEADER_OBJECT
+    }
+
+    void collectParts(MessageParts& parts, GMimeObject * part, bool isTopLevel) {
+      auto type = g_mime_object_get_content_type(part);
+      if (!type) {
+        if (isTopLevel) {
+          parts.text = part;
+        } else {
+          KJ_FAIL_ASSERT("Unhandled mime part with unkown type");
+        }
+      } else {
+        if (g_mime_object_get_disposition(part) != NULL) {
+            parts.attachments.add(part);
+        } else if (g_mime_content_type_is_type(type, "text", "*")) {
+          if (g_mime_content_type_is_type(type, "text", "html")) {
+            parts.html = part;
+          } else {
+            parts.text = part;
+          }
+        } else if (GMIME_IS_MULTIPART(part)) {
+          GMimeMultipart * multipart = (GMimeMultipart *)part;
+          int numParts = g_mime_multipart_get_count(multipart);
+
+          for(int i = 0; i < numParts; ++i) {
+            auto subPart = g_mime_multipart_get_part(multipart, i);
+            collectParts(parts, subPart, false);
+          }
+        } else {
+          KJ_FAIL_ASSERT("Unhandled mime part", g_mime_content_type_to_string(type));
+        }
+      }
+    }
+
+    kj::Promise<void> setBody(sandstorm::EmailMessage::Builder email, GMimeObject * part,
+                              StageTimer& build) {
+      // Large attachments may still be decoding on the DecodePool when this returns; the
+      // returned promise resolves once they are in place. The time spent here is taken out of
+      // `build`, so BUILD and DECODE do not count it twice.
+      StageTimer timer(Stage::DECODE);
+      KJ_DEFER(build.exclude(timer.elapsed()));
+      MessageParts parts;
+      collectParts(parts, part, true);
+      auto orphanage = capnp::Orphanage::getForMessageContaining(email);
+
+      if (parts.text != nullptr) {
+        auto orphan = decodePart<capnp::Text>(orphanage, parts.text);
+        if (orphan.get().size() > 0) {
+          email.adoptText(kj::mv(orphan));
+        }
+      }
+      if (parts.html != nullptr) {
+        auto orphan = decodePart<capnp::Text>(orphanage, parts.html);
+        if (orphan.get().size() > 0) {
+          email.adoptHtml(kj::mv(orphan));
+        }
+      }
+
+      auto attachments = email.initAttachments(parts.attachments.size());
+      kj::Vector<ParallelDecode> parallel;
+      for (size_t i = 0; i < parts.attachments.size(); ++i) {
+        auto part = parts.attachments[i];
+        if (decoder != nullptr) {
+          GMimeContentEncoding encoding;
+          KJ_IF_MAYBE(raw, rawEncodedContent(part, encoding)) {
+            if (raw->size() >= PARALLEL_DECODE_THRESHOLD) {
+              auto content = orphanage.newOrphan<capnp::Data>(decodedSizeBound(*raw, encoding));
+              auto out = content.get();
+              parallel.add(ParallelDecode { (uint)i, *raw, encoding, kj::mv(content), out, 0 });
+              setAttachmentHeaders(attachments[i], part);
+              continue;
+            }
+          }
+        }
+        addAttachment(attachments[i], part);
+      }
+
+      if (parallel.size() == 0) {
+        return kj::READY_NOW;
+      }
+      auto slots = kj::heap<kj::Array<ParallelDecode>>(parallel.releaseAsArray());
+      auto decoded = decodeInParallel(*slots);
+      return decoded.then([attachments, slots = kj::mv(slots)]() mutable {
+        for (auto& slot: *slots) {
+          slot.content.truncate(slot.size);
+          attachments[slot.index].adoptContent(kj::mv(slot.content));
+        }
+      });
+    }
+
+    struct ParallelDecode {
+      // A large attachment whose output blob has been allocated up front, so that the decode
+      // itself can run on another thread. The message is only touched again once it is done.
+      uint index;
+      kj::ArrayPtr<const capnp::byte> raw;
+      GMimeContentEncoding encoding;
+      capnp::Orphan<capnp::Data> content;
+      kj::ArrayPtr<capnp::byte> out;
+      size_t size;
+    };
+
+    kj::Promise<void> decodeInParallel(kj::ArrayPtr<ParallelDecode> slots) {
+      auto jobs = kj::heapArrayBuilder<kj::Function<void()>>(slots.size());
+      for (auto& slot: slots) {
+        ParallelDecode* slotPtr = &slot;
+        jobs.add([slotPtr]() {
+          // Recorded on the helper, as its own DECODE sample.
+          StageTimer timer(Stage::DECODE);
+          slotPtr->size = decodeInto(slotPtr->raw, slotPtr->encoding, slotPtr->out);
+        });
+      }
+      return decoder->run(jobs.finish());
+    }
+
+    kj::Promise<void> buildEmail(sandstorm::EmailMessage::Builder email, GMimeMessage* msg) {
+      // Fills in `email`. Resolves once any attachments decoding on the DecodePool are done;
+      // until then `email`'s message and `msg` must stay alive, and `msg` unmodified.
+      StageTimer timer(Stage::BUILD);
+      auto part = g_mime_message_get_mime_part(msg);
+
+      KJ_REQUIRE(GMIME_IS_OBJECT(msg), "Message was unable to parsed as a valid MIME object");
+      KJ_IF_MAYBE(raw, rawMessageContents(msg)) {
+        setHeaders(email, *raw);
+      } else {
+        char * headerText = g_mime_object_get_headers((GMimeObject*)msg);
+        KJ_DEFER(g_free(headerText));
+        setHeaders(email, kj::arrayPtr(headerText, strlen(headerText)));
+      }
+
+      // TODO: parse data
+      struct timeval tv;
+      gettimeofday(&tv,NULL);
+      email.setDate(tv.tv_sec*(uint64_t)1000000000+tv.tv_usec*1000);
+
+      if (!part) {
+        // Fail?
+        KJ_SYSCALL(write(STDERR_FILENO, STRING_AND_SIZE("sandstorm-smtp-bridge: Mime part of email wan't found?")));
+        auto objStr = g_mime_object_to_string((GMimeObject*)msg);
+        email.setText(objStr);
+        g_free(objStr);
+        return kj::READY_NOW;
+      } else {
+        return setBody(email, part, timer);
+      }
+    }
+  };
+
+  capnp::MessageSize emailSizeHint(uint64_t messageSize) {
+    // A guess at how big the EmailMessage for a raw message of `messageSize` bytes will be, used
+    // to size the first segment of its builder. Decoded bodies and attachments are never larger
+    // than their encoded form, so this is usually an overestimate, which costs only untouched
+    // (lazily mapped) memory; growing segment by segment costs a copy each time.
+    return capnp::MessageSize { messageSize / sizeof(capnp::word) + 1024, 0 };
+  }
+
+  struct DeliveryOptions {
+    uint maxInFlight = 4;
+    // How many EmailSendPort.send() calls may be outstanding at once.
+
+    uint64_t maxQueuedBytes = 256ull << 20;
+    // Once this many bytes of mail are waiting or in flight, new transactions get a 452 until
+    // the queue drains.
+
+    bool ackAfterDelivery = false;
+    // If false, a message is acknowledged with 250 as soon as it is queued. If true, the reply
+    // waits for send() to return, and a failed delivery is reported to the client with a 451.
+
+    DecodePool* decodePool = nullptr;
+    // If set, large attachments are decoded on this pool in parallel, off the event loop.
+
+    uint maxAttempts = 3;
+    // How many times a message is sent before giving up, when the connection to the grain breaks
+    // under it. Other failures are never retried. Above 1, a message's MIME tree is kept until it
+    // has been delivered, so it can be converted again.
+  };
+
+  class SendPortLease {
+    // One EmailSendPort, held for the duration of one send().
+
+  public:
+    virtual ~SendPortLease() noexcept(false) {}
+    virtual EmailSendPort::Client& getCap() = 0;
+
+    virtual void delivered() {}
+    // Called once send() through this lease has succeeded, i.e. the port is known to work.
+  };
+
+  class SendPortProvider {
+    // Where a DeliveryQueue gets the EmailSendPort for each message.
+
+  public:
+    virtual ~SendPortProvider() noexcept(false) {}
+
+    virtual kj::Promise<kj::Own<SendPortLease>> acquire(uint64_t size) = 0;
+    // Resolves with a port to send a message of `size` bytes through, once one is available.
+  };
+
+  class SingleSendPort final: public SendPortProvider {
+    // Sends everything through one capability.
+
+  public:
+    explicit SingleSendPort(EmailSendPort::Client cap): cap(kj::mv(cap)) {}
+
+    kj::Promise<kj::Own<SendPortLease>> acquire(uint64_t size) override {
+      return kj::Own<SendPortLease>(kj::heap<Lease>(cap));
+    }
+
+  private:
+    class Lease final: public SendPortLease {
+    public:
+      explicit Lease(EmailSendPort::Client& cap): cap(cap) {}
+      EmailSendPort::Client& getCap() override { return cap; }
+
+    private:
+      EmailSendPort::Client& cap;
+    };
+
+    EmailSendPort::Client cap;
+  };
+
+  class SpoolingQueue {
+    // The part of a MailQueue that passes messages through a spool before they are acknowledged.
+
+  public:
+    struct Spooled {
+      kj::Promise<void> delivered;
+      // Resolves once the grain has accepted the message, or breaks if delivery fails. Dropping
+      // it does not cancel delivery.
+    };
+
+    virtual kj::Promise<Spooled> append(kj::ArrayPtr<const char> message) = 0;
+    // Writes the raw `message` to the spool and queues it for delivery. `message` is only used
+    // during the call. Resolves once the message is durable, or breaks if it couldn't be stored,
+    // in which case it won't be delivered.
+
+  protected:
+    ~SpoolingQueue() noexcept(false) {}
+  };
+
+  class MailQueue {
+    // Where an AcceptedConnection hands the messages it receives.
+
+  public:
+    virtual ~MailQueue() noexcept(false) {}
+
+    virtual const DeliveryOptions& getOptions() = 0;
+
+    virtual kj::Maybe<SpoolingQueue&> getSpooling() { return nullptr; }
+    // Set if received messages must be written to the spool before they are acknowledged.
+
+    virtual bool isFull() = 0;
+    // True while new transactions should be refused with 452.
+
+    virtual void countRejected() = 0;
+
+    virtual kj::Promise<void> enqueue(kj::Own<GMimeMessage>&& message, uint64_t size,
+                                      MemoryCharge&& charge) = 0;
+    // Queues `message` for delivery. The returned promise resolves once the grain has accepted
+    // it, or breaks if delivery fails. Dropping the promise does not cancel delivery. `charge`,
+    // the message's share of the memory budget, is held until delivery is over either way.
+  };
+
+  class DeliveryQueue final: public MailQueue, public SpoolingQueue,
+                             private kj::TaskSet::ErrorHandler {
+    // Stands between the SMTP connections and the grain's EmailSendPort, so a slow or waking
+    // grain doesn't hold up every client for the full RPC latency. Messages are delivered in
+    // arrival order, at most `maxInFlight` at a time.
+    //
+    // With a spool, queued messages live on disk and are only parsed when their turn comes. A
+    // spooled message is retired once delivered. If send() fails it stays in the spool to be
+    // replayed on restart, unless the client was told about the failure (ackAfterDelivery) and
+    // will retry itself, or the message can't be converted at all and would never succeed.
+
+  public:
+    struct Stats {
+      uint64_t queuedMessages = 0;  // waiting for a send slot
+      uint64_t inFlight = 0;        // send() outstanding
+      uint64_t queuedBytes = 0;     // waiting or in flight
+      uint64_t peakQueuedBytes = 0;
+      uint64_t delivered = 0;
+      uint64_t failed = 0;
+      uint64_t rejected = 0;        // transactions refused with 452
+      uint64_t retried = 0;         // sends repeated after a broken connection
+    };
+
+    DeliveryQueue(SendPortProvider& ports, DeliveryOptions options,
+                  kj::Maybe<Spool&> spool = nullptr, kj::LowLevelAsyncIoProvider* io = nullptr)
+        : ports(ports), options(options), spool(spool), tasks(*this) {
+      // `io` is needed only with a decode pool, which reports back to this thread through it.
+      if (options.decodePool != nullptr) {
+        KJ_REQUIRE(io != nullptr, "a DeliveryQueue with a decode pool needs its event loop");
+        decoder = kj::heap<DecodeClient>(*options.decodePool, *io);
+      }
+    }
+
+    const DeliveryOptions& getOptions() override { return options; }
+    const Stats& getStats() { return stats; }
+
+    kj::Promise<void> whenIdle() {
+      // Resolves once nothing is queued or in flight, e.g. so a tool can report after the last
+      // delivery without polling.
+      if (stats.queuedMessages == 0 && stats.inFlight == 0) {
+        return kj::READY_NOW;
+      }
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      idleWaiters.add(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    }
+
+    kj::Maybe<SpoolingQueue&> getSpooling() override {
+      if (spool == nullptr) {
+        return nullptr;
+      }
+      return static_cast<SpoolingQueue&>(*this);
+    }
+
+    kj::Promise<Spooled> append(kj::ArrayPtr<const char> message) override {
+      auto& s = KJ_REQUIRE_NONNULL(spool, "no spool configured");
+      return s.append(message).then([this](kj::Own<SpoolRecord>&& record) {
+        return Spooled { enqueue(kj::mv(record)) };
+      });
+    }
+
+    bool isFull() override {
+      return stats.queuedBytes >= options.maxQueuedBytes;
+    }
+
+    void countRejected() override {
+      ++stats.rejected;
+      KJ_LOG(WARNING, "delivery queue full", stats.queuedMessages, stats.inFlight, stats.queuedBytes);
+    }
+
+    kj::Promise<void> enqueue(kj::Own<GMimeMessage>&& message, uint64_t size,
+                              MemoryCharge&& charge) override {
+      auto entry = kj::heap<Entry>();
+      entry->message = kj::mv(message);
+      entry->size = size;
+      entry->charge = kj::mv(charge);
+      return push(kj::mv(entry));
+    }
+
+    kj::Promise<void> enqueue(kj::Own<capnp::MallocMessageBuilder>&& email, uint64_t size,
+                              MemoryCharge&& charge = MemoryCharge()) {
+      // Like above, for a message already converted, e.g. on another thread. Its root must be
+      // an EmailMessage; it is copied into the request when sent.
+      auto entry = kj::heap<Entry>();
+      entry->prebuilt = kj::mv(email);
+      entry->size = size;
+      entry->charge = kj::mv(charge);
+      return push(kj::mv(entry));
+    }
+
+    kj::Promise<void> enqueue(kj::Own<SpoolRecord>&& record) {
+      // Like above, for a message already in the spool, e.g. recovered on startup. It is
+      // retired once delivered.
+      auto entry = kj::heap<Entry>();
+      entry->size = record->size();
+      entry->record = kj::mv(record);
+      return push(kj::mv(entry));
+    }
+
+  private:
+    struct Entry {
+      // Exactly one of `message`, `prebuilt` and `record` is set when queued.
+      kj::Own<GMimeMessage> message;
+      kj::Own<capnp::MallocMessageBuilder> prebuilt;
+      kj::Maybe<kj::Own<SpoolRecord>> record;
+      uint64_t size;
+      uint attempts = 0;
+      bool unconvertible = false;
+      MemoryCharge charge;  // given back with the entry
+      kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+      kj::Own<Entry> next;
+    };
+
+    SendPortProvider& ports;
+    DeliveryOptions options;
+    kj::Array<kj::byte> translatorScratch = kj::heapArray<kj::byte>(TRANSLATOR_SCRATCH_SIZE);
+    kj::Maybe<Spool&> spool;
+    Stats stats;
+    kj::Own<Entry> head;
+    Entry* tail = nullptr;
+    kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> idleWaiters;
+    kj::Own<DecodeClient> decoder;
+    // Declared before `tasks`: deliveries cancelled along with `tasks` wait for their decodes on
+    // the way out, which needs the client still there.
+    kj::TaskSet tasks;
+
+    kj::Promise<void> push(kj::Own<Entry>&& entry) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      entry->fulfiller = kj::mv(paf.fulfiller);
+
+      Entry* entryPtr = entry.get();
+      if (tail == nullptr) {
+        head = kj::mv(entry);
+      } else {
+        tail->next = kj::mv(entry);
+      }
+      tail = entryPtr;
+
+      ++stats.queuedMessages;
+      stats.queuedBytes += entryPtr->size;
+      stats.peakQueuedBytes = kj::max(stats.peakQueuedBytes, stats.queuedBytes);
+      pump();
+      return kj::mv(paf.promise);
+    }
+
+    void pump() {
+      while (stats.inFlight < options.maxInFlight && head.get() != nullptr) {
+        auto entry = kj::mv(head);
+        head = kj::mv(entry->next);
+        if (head.get() == nullptr) {
+          tail = nullptr;
+        }
+        --stats.queuedMessages;
+        ++stats.inFlight;
+        tasks.add(deliver(kj::mv(entry)));
+      }
+    }
+
+    kj::Promise<void> deliver(kj::Own<Entry>&& entry) {
+      Entry& ref = *entry;
+      return attempt(ref).then([this, &ref]() {
+        ++stats.delivered;
+        finish(ref, true);
+        ref.fulfiller->fulfill();
+      }, [this, &ref](kj::Exception&& exception) {
+        // A message that can't be converted would never succeed, so it is retired either way.
+        fail(ref, kj::mv(exception), ref.unconvertible || options.ackAfterDelivery);
+      }).attach(kj::mv(entry));
+    }
+
+    kj::Promise<void> attempt(Entry& ref) {
+      // Sends `ref` once, and again as long as sends fail because the connection broke.
+      ++ref.attempts;
+      return ports.acquire(ref.size).then([this, &ref](kj::Own<SendPortLease>&& lease)
+                                          -> kj::Promise<void> {
+        kj::Promise<void> sent = nullptr;
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+          auto& cap = lease->getCap();
+          auto req = ref.prebuilt.get() != nullptr
+              ? cap.sendRequest(ref.prebuilt->getRoot<sandstorm::EmailMessage>().asReader().totalSize())
+              : cap.sendRequest(emailSizeHint(ref.size));
+          kj::Promise<void> built = kj::READY_NOW;
+          if (ref.prebuilt.get() != nullptr) {
+            req.setEmail(ref.prebuilt->getRoot<sandstorm::EmailMessage>().asReader());
+            if (options.maxAttempts <= 1) {
+              ref.prebuilt = nullptr;
+            }
+          } else {
+            if (ref.message.get() == nullptr) {
+              auto stream = KJ_ASSERT_NONNULL(ref.record)->openStream();
+              KJ_DEFER(g_object_unref(stream));
+              ref.message = ownGObject(parse_message(stream));
+              KJ_REQUIRE(ref.message.get() != nullptr, "Message was unable to parsed as a valid MIME object");
+            }
+            built = EmailTranslator(decoder.get(), translatorScratch)
+                .buildEmail(req.getEmail(), ref.message.get());
+          }
+          sent = built.then([this, &ref, req = kj::mv(req)]() mutable -> kj::Promise<void> {
+            if (ref.record != nullptr || options.maxAttempts <= 1) {
+              // Nothing to keep it for: the request holds everything now, and a retry can parse
+              // the spooled copy again. Let go of the MIME tree while the RPC is out.
+              ref.message = nullptr;
+            }
+            uint64_t sendStart = nowNanos();
+            return req.send().then([sendStart](auto results) -> kj::Promise<void> {
+              recordStage(Stage::SEND, sendStart);
+              return kj::READY_NOW;
+            }, [sendStart](kj::Exception&& exception) -> kj::Promise<void> {
+              recordStage(Stage::SEND, sendStart);
+              return kj::mv(exception);
+            });
+          }, [&ref](kj::Exception&& exception) -> kj::Promise<void> {
+            ref.unconvertible = true;
+            return kj::mv(exception);
+          });
+        })) {
+          ref.unconvertible = true;
+          return kj::mv(*exception);
+        }
+
+        SendPortLease& leaseRef = *lease;
+        return sent.then([&leaseRef]() { leaseRef.delivered(); }).attach(kj::mv(lease));
+      }).then([]() -> kj::Promise<void> {
+        return kj::READY_NOW;
+      }, [this, &ref](kj::Exception&& exception) -> kj::Promise<void> {
+        if (!ref.unconvertible && exception.getType() == kj::Exception::Type::DISCONNECTED &&
+            ref.attempts < options.maxAttempts) {
+          KJ_LOG(WARNING, "connection to the grain broke during delivery; retrying", ref.attempts);
+          ++stats.retried;
+          return attempt(ref);
+        }
+        return kj::mv(exception);
+      });
+    }
+
+    void fail(Entry& entry, kj::Exception&& exception, bool retire) {
+      ++stats.failed;
+      KJ_LOG(ERROR, "failed to deliver message", exception);
+      finish(entry, retire);
+      entry.fulfiller->reject(kj::mv(exception));
+    }
+
+    void finish(Entry& entry, bool retire) {
+      --stats.inFlight;
+      stats.queuedBytes -= entry.size;
+      // Give the memory back now rather than whenever the task holding the entry is cleaned up.
+      entry.message = nullptr;
+      entry.prebuilt = nullptr;
+      entry.charge = MemoryCharge();
+      KJ_IF_MAYBE(record, entry.record) {
+        if (retire) {
+          // If this fails the message is delivered again after a restart, which beats losing
+          // the slot.
+          KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { (*record)->retire(); })) {
+            KJ_LOG(ERROR, "can't retire delivered message from the spool", *exception);
+          }
+        } else {
+          KJ_LOG(WARNING, "leaving undelivered message in the spool until restart");
+        }
+        entry.record = nullptr;
+      }
+      pump();
+
+      if (stats.queuedMessages == 0 && stats.inFlight == 0 && idleWaiters.size() > 0) {
+        auto waiters = kj::mv(idleWaiters);
+        idleWaiters = kj::Vector<kj::Own<kj::PromiseFulfiller<void>>>();
+        for (auto& waiter: waiters) {
+          waiter->fulfill();
+        }
+      }
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, "delivery task failed", exception);
+    }
+  };
+
+  enum class SessionState {
+    // Where an SMTP session is in RFC 5321's command sequence.
+    CONNECTED,  // before HELO/EHLO
+    GREETED,    // no mail transaction in progress
+    MAIL,       // MAIL accepted, no recipients yet
+    RCPT,       // at least one recipient; DATA or BDAT may follow
+  };
+
+  static const size_t MAX_RECIPIENTS = 1000;
+  // RFC 5321 §4.5.3.1.8 asks for at least 100.
+
+  class Envelope {
+    // Sender and recipients of the current mail transaction. The storage is kept from one
+    // transaction to the next, so a connection stops allocating for envelopes once it has seen
+    // its largest one.
+
+  public:
+    void clear() {
+      textUsed = 0;
+      recipientsUsed = 0;
+      sender = Span { 0, 0 };
+    }
+
+    void setSender(kj::ArrayPtr<const char> path) {
+      clear();
+      sender = store(path);
+    }
+
+    void addRecipient(kj::ArrayPtr<const char> path) {
+      Span span = store(path);
+      if (recipientsUsed == recipients.size()) {
+        auto grown = kj::heapArray<Span>(kj::max(recipients.size() * 2, size_t(8)));
+        memcpy(grown.begin(), recipients.begin(), recipientsUsed * sizeof(Span));
+        recipients = kj::mv(grown);
+      }
+      recipients[recipientsUsed++] = span;
+    }
+
+    kj::ArrayPtr<const char> getSender() { return get(sender); }
+    size_t recipientCount() { return recipientsUsed; }
+    kj::ArrayPtr<const char> getRecipient(size_t i) { return get(recipients[i]); }
+
+  private:
+    struct Span {
+      size_t offset;
+      size_t size;
+    };
+
+    kj::Array<char> text;
+    size_t textUsed = 0;
+    kj::Array<Span> recipients;
+    size_t recipientsUsed = 0;
+    Span sender = { 0, 0 };
+
+    Span store(kj::ArrayPtr<const char> value) {
+      if (textUsed + value.size() > text.size()) {
+        auto grown = kj::heapArray<char>(kj::max(text.size() * 2, textUsed + value.size() + 256));
+        memcpy(grown.begin(), text.begin(), textUsed);
+        text = kj::mv(grown);
+      }
+      memcpy(text.begin() + textUsed, value.begin(), value.size());
+      Span result = { textUsed, value.size() };
+      textUsed += value.size();
+      return result;
+    }
+
+    kj::ArrayPtr<const char> get(Span span) {
+      return kj::arrayPtr(text.begin() + span.offset, span.size);
+    }
+  };
+
+  class ReplyBatch {
+    // Replies queued to go out in one write. The storage is kept from one batch to the next.
+
+  public:
+    void add(const char* text, size_t size) {
+      if (count == pieces.size()) {
+        auto grown = kj::heapArray<kj::ArrayPtr<const capnp::byte>>(kj::max(count * 2, size_t(8)));
+        for (size_t i = 0; i < count; i++) {
+          grown[i] = pieces[i];
+        }
+        pieces = kj::mv(grown);
+      }
+      pieces[count++] = kj::arrayPtr(reinterpret_cast<const capnp::byte*>(text), size);
+    }
+
+    size_t size() { return count; }
+    kj::ArrayPtr<const kj::ArrayPtr<const capnp::byte>> get() { return pieces.slice(0, count); }
+    void clear() { count = 0; }
+
+  private:
+    kj::Array<kj::ArrayPtr<const capnp::byte>> pieces;
+    size_t count = 0;
+  };
+
+  struct AcceptedConnection {
+    kj::Own<kj::AsyncIoStream> connection;
+    MailQueue& deliveryQueue;
+    ReceiveBuffer input;
+    size_t readSize = MIN_READ_SIZE;
+    ReplyBatch replies[2];
+    uint currentReplies = 0;
+    // Replies are queued in one batch while the other may still be going out.
+    kj::Maybe<kj::Own<MessageSink>> bdatMessage;
+    // The message being assembled from BDAT chunks, until the LAST one.
+    bool binaryMime = false;
+    // MAIL FROM declared BODY=BINARYMIME, so the message may only come by BDAT.
+    DotUnstuffer unstuffer;
+    SessionState state = SessionState::CONNECTED;
+    Envelope envelope;
+
+    const ReceiveOptions& receiveOptions;
+    kj::String ehloReply;
+
+    uint64_t acceptedAt = nowNanos();
+    uint64_t stageStart = 0;
+    // When the command read or DATA section currently being timed began.
+
+    kj::Timer& timer;
+    kj::TimePoint commandDeadline;
+    bool receivingData = false;
+    kj::TimePoint dataStartTime;
+    uint64_t dataStartBytes = 0;
+    uint64_t bytesRead = 0;
+    bool timedOut = false;
+
+    kj::Maybe<kj::Own<SessionCapture>> capture;
+
+    explicit AcceptedConnection(kj::Own<kj::AsyncIoStream>&& connectionParam, MailQueue& deliveryQueue,
+                                const ReceiveOptions& receiveOptions, kj::Timer& timer)
+        : connection(kj::mv(connectionParam)), deliveryQueue(deliveryQueue),
+          input(receiveOptions.memoryBudget), receiveOptions(receiveOptions),
+          ehloReply(kj::str(
+              "250-Sandstorm at your service\r\n"
+              "250-PIPELINING\r\n"
+              "250-SIZE ", receiveOptions.maxMessageSize, "\r\n"
+              "250-8BITMIME\r\n"
+              "250-CHUNKING\r\n"
+              "250 BINARYMIME\r\n")),
+          timer(timer), commandDeadline(timer.now()), dataStartTime(commandDeadline) {
+      countStat(Counter::CONNECTIONS);
+      countStat(Counter::ACTIVE_CONNECTIONS);
+      if (receiveOptions.captureDirectory.size() > 0) {
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+          capture = kj::heap<SessionCapture>(receiveOptions.captureDirectory);
+        })) {
+          KJ_LOG(ERROR, "can't capture session", *exception);
+        }
+      }
+    }
+
+    void captured(const void* data, size_t size) {
+      KJ_IF_MAYBE(c, capture) {
+        (*c)->record(data, size);
+      }
+    }
+
+    ~AcceptedConnection() noexcept(false) {
+      countStat(Counter::ACTIVE_CONNECTIONS, -1);
+    }
+
+    void startCommand() {
+      receivingData = false;
+      commandDeadline = timer.now() + receiveOptions.commandTimeout;
+    }
+
+    void startData() {
+      receivingData = true;
+      dataStartTime = timer.now();
+      dataStartBytes = bytesRead;
+    }
+
+    kj::TimePoint readDeadline() {
+      if (!receivingData) {
+        return commandDeadline;
+      }
+      uint64_t received = bytesRead - dataStartBytes;
+      return dataStartTime + receiveOptions.dataTimeout +
+          int64_t(received * 1000 / receiveOptions.minDataRate) * kj::MILLISECONDS;
+    }
+
+    template <typename T>
+    kj::Promise<T> withDeadline(kj::TimePoint deadline, kj::Promise<T>&& promise) {
+      // Like `promise`, but cancelled with an exception once `deadline` passes.
+      return promise.exclusiveJoin(timer.atTime(deadline).then([this]() -> kj::Promise<T> {
+        timedOut = true;
+        return KJ_EXCEPTION(DISCONNECTED, "client timed out");
+      }));
+    }
+
+    kj::Promise<size_t> fill() {
+      // Reads one chunk from the socket into `input`. Resolves to the number of bytes read, 0 at EOF.
+      auto space = input.reserve(readSize);
+      const char* start = space.begin();
+      size_t maxBytes = kj::min(space.size(), readSize);
+      return withDeadline(readDeadline(), connection->tryRead(space.begin(), 1, maxBytes))
+          .then([this, start](size_t size) {
+        captured(start, size);
+        bytesRead += size;
+        countStat(Counter::BYTES_IN, size);
+        input.commit(size);
+        if (size == readSize && readSize < MAX_READ_SIZE) {
+          readSize *= 2;
+        }
+        return size;
+      });
+    }
+
+    typedef kj::Maybe<kj::ArrayPtr<const char>> MaybeLine;
+
+    kj::Promise<MaybeLine> readUntil(kj::StringPtr delimiter, size_t limit, size_t scanned = 0) {
+      // Returns everything up to and including `delimiter`, or whatever is left at EOF, and
+      // consumes it. The result points into the receive buffer and stays valid until the next
+      // fill(). If that would be more than `limit` bytes, the whole line is consumed without
+      // being buffered and null is returned instead. `scanned` is how much of the pending data
+      // an earlier call already searched; only the last delimiter.size() - 1 bytes of it are
+      // searched again, in case the delimiter straddles reads.
+      auto data = input.pending();
+      size_t from = scanned >= delimiter.size() ? scanned - delimiter.size() + 1 : 0;
+      KJ_IF_MAYBE(pos, find(data, delimiter, from)) {
+        kj::ArrayPtr<const char> result = data.slice(0, *pos + delimiter.size());
+        input.consume(result.size());
+        if (result.size() > limit) {
+          return MaybeLine(nullptr);
+        }
+        return MaybeLine(result);
+      }
+      if (data.size() >= limit) {
+        return skipLine().then([]() {
+          return MaybeLine(nullptr);
+        });
+      }
+
+      return fill().then([this, delimiter, limit, scanned=data.size()](size_t size)
+                         -> kj::Promise<MaybeLine> {
+        if (size == 0) {
+          kj::ArrayPtr<const char> rest = input.pending();
+          input.consume(rest.size());
+          return MaybeLine(rest);
+        }
+        return readUntil(delimiter, limit, scanned);
+      });
+    }
+
+    kj::Promise<void> skipLine() {
+      // Drops everything up to and including the next CRLF, consuming it as it arrives. A bare
+      // '\n' doesn't end the line, as with readUntil().
+      auto data = input.pending();
+      KJ_IF_MAYBE(pos, find(data, kj::StringPtr(END_LINE))) {
+        input.consume(*pos + 2);
+        return kj::READY_NOW;
+      }
+      // Keep a trailing '\r', whose '\n' may be in the next read.
+      input.consume(data.size() > 0 && data[data.size() - 1] == '\r' ? data.size() - 1 : data.size());
+      return fill().then([this](size_t size) -> kj::Promise<void> {
+        if (size == 0) {
+          return kj::READY_NOW;
+        }
+        return skipLine();
+      });
+    }
+
+    kj::Promise<void> readData(MessageSink& sink) {
+      // Streams a DATA section into `sink`, undoing dot-stuffing as the bytes arrive.
+      unstuffer.reset(sink);
+      return readDataHelper();
+    }
+
+    kj::Promise<void> readDataHelper() {
+      input.consume(unstuffer.feed(input.pending()));
+      if (unstuffer.isDone()) {
+        return kj::READY_NOW;
+      }
+
+      return fill().then([this](size_t size) {
+        KJ_REQUIRE(size > 0, "connection closed in the middle of DATA");
+        return readDataHelper();
+      });
+    }
+
+    kj::Promise<void> skipChunk(uint64_t size) {
+      // Reads and drops `size` bytes, reusing the receive buffer.
+      size_t n = kj::min(input.pending().size(), size);
+      input.consume(n);
+      if (n == size) {
+        return kj::READY_NOW;
+      }
+      return fill().then([this, size, n](size_t read) {
+        KJ_REQUIRE(read > 0, "connection closed in the middle of BDAT");
+        return skipChunk(size - n);
+      });
+    }
+
+    kj::Promise<void> start() {
+      static const char GREETING[] = "220 Sandstorm SMTP Bridge\r\n";
+      countStat(Counter::BYTES_OUT, sizeof(GREETING) - 1);
+      return withDeadline(timer.now() + receiveOptions.commandTimeout,
+                          connection->write(GREETING, sizeof(GREETING) - 1)).then(
+          [this]() {
+            recordStage(Stage::ACCEPT, acceptedAt);
+            return messageLoop();
+      }).then([]() -> kj::Promise<void> {
+        return kj::READY_NOW;
+      }, [this](kj::Exception&& err) -> kj::Promise<void> {
+        // Covers the whole session, so a client that stalls in DATA or BDAT is treated the same
+        // as one that stalls between commands.
+        if (timedOut) {
+          // RFC 5321 §4.5.3.2: say why before closing, if the client will still listen.
+          countStat(Counter::TIMEOUTS);
+          return connection->write(STRING_AND_SIZE("421 4.4.2 Timeout, closing connection"))
+              .exclusiveJoin(timer.afterDelay(1 * kj::SECONDS))
+              .then([]() {}, [](kj::Exception&& exception) {});
+        }
+        KJ_LOG(ERROR, err);
+        return kj::READY_NOW;
+        // Swallow exception and quit looping server
+      });
+    }
+
+    kj::Promise<void> deliverMessage(MessageSink& sink) {
+      // Hands a fully received message to the delivery queue and queues the reply to the client.
+      // With a spool, the message is acknowledged only once it is safely on disk.
+      KJ_IF_MAYBE(spooling, deliveryQueue.getSpooling()) {
+        kj::Promise<SpoolingQueue::Spooled> spooled = nullptr;
+        KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+          spooled = spooling->append(sink.getContents());
+        })) {
+          spooled = kj::mv(*exception);
+        }
+        return spooled.then([this](SpoolingQueue::Spooled&& spooled) {
+          return acknowledge(kj::mv(spooled.delivered));
+        }, [this](kj::Exception&& exception) -> kj::Promise<void> {
+          // Nothing was acknowledged, so the client still has the message and can try again.
+          KJ_LOG(ERROR, "can't spool message", exception);
+          reply(STRING_AND_SIZE("451 4.3.0 Could not store message, try again later"));
+          return kj::READY_NOW;
+        });
+      }
+
+      auto message = sink.parse();
+      KJ_REQUIRE(message != nullptr, "Message was unable to parsed as a valid MIME object");
+      return acknowledge(deliveryQueue.enqueue(ownGObject(message), sink.size(),
+                                               sink.takeCharge()));
+    }
+
+    kj::Promise<void> acknowledge(kj::Promise<void>&& delivered) {
+      if (!deliveryQueue.getOptions().ackAfterDelivery) {
+        reply(STRING_AND_SIZE("250 OK"));
+        return kj::READY_NOW;
+      }
+
+      return delivered.then([this]() {
+        reply(STRING_AND_SIZE("250 OK"));
+      }, [this](kj::Exception&& exception) {
+        reply(STRING_AND_SIZE("451 4.3.0 Delivery to the grain failed"));
+      });
+    }
+
+    bool rejectIfQueueFull() {
+      if (deliveryQueue.isFull()) {
+        deliveryQueue.countRejected();
+        reply(STRING_AND_SIZE("452 4.3.1 Insufficient system storage"));
+        return true;
+      }
+      return false;
+    }
+
+    kj::Promise<void> readChunk(MessageSink& sink, uint64_t size) {
+      // Moves exactly `size` bytes into `sink`: first whatever is already buffered, then the rest
+      // straight from the socket. Nothing is scanned, and nothing past the chunk is read.
+      auto buffered = input.pending();
+      size_t n = kj::min(buffered.size(), size);
+      sink.write(buffered.slice(0, n));
+      input.consume(n);
+      return readChunkDirect(sink, size - n);
+    }
+
+    kj::Promise<void> readChunkDirect(MessageSink& sink, uint64_t size) {
+      if (size == 0) {
+        return kj::READY_NOW;
+      }
+      auto space = sink.prepareWrite(kj::min(size, MAX_READ_SIZE));
+      MessageSink* sinkPtr = &sink;
+      const char* start = space.begin();
+      return withDeadline(readDeadline(), connection->tryRead(space.begin(), 1, space.size()))
+          .then([this, sinkPtr, size, start](size_t n) {
+        captured(start, n);
+        bytesRead += n;
+        countStat(Counter::BYTES_IN, n);
+        sinkPtr->commitWrite(n);
+        KJ_REQUIRE(n > 0, "connection closed in the middle of BDAT");
+        return readChunkDirect(*sinkPtr, size - n);
+      });
+    }
+
+    void reply(const char* text, size_t size) {
+      // Queues a reply. Queued replies go out together in flushReplies().
+      replies[currentReplies].add(text, size);
+    }
+
+    kj::Promise<void> flushReplies() {
+      // Only one flush is outstanding at a time, so the other batch is free to queue into.
+      ReplyBatch& batch = replies[currentReplies];
+      if (batch.size() == 0) {
+        return kj::READY_NOW;
+      }
+      currentReplies ^= 1;
+      replies[currentReplies].clear();
+      auto pieces = batch.get();
+      size_t bytes = 0;
+      for (auto& piece: pieces) {
+        bytes += piece.size();
+      }
+      countStat(Counter::BYTES_OUT, bytes);
+      return withDeadline(timer.now() + receiveOptions.commandTimeout, connection->write(pieces));
+    }
+
+    bool hasPendingCommand() {
+      return find(input.pending(), END_LINE) != nullptr;
+    }
+
+    static kj::Maybe<kj::ArrayPtr<const char>> mailParameter(kj::ArrayPtr<const char> params,
+                                                             kj::StringPtr keyword) {
+      // The value of the first `keyword`=<value> parameter among MAIL FROM parameters, if any.
+      // `keyword` is lower case and includes the '='.
+      params = trim(params);
+      while (params.size() > 0) {
+        kj::ArrayPtr<const char> param = params;
+        KJ_IF_MAYBE(first, splitFirst(params, ' ')) {
+          param = *first;
+        } else {
+          params = nullptr;
+        }
+        if (param.size() > keyword.size() &&
+            strncasecmp(param.begin(), keyword.cStr(), keyword.size()) == 0) {
+          return param.slice(keyword.size(), param.size());
+        }
+      }
+      return nullptr;
+    }
+
+    static kj::Maybe<uint64_t> sizeParameter(kj::ArrayPtr<const char> params) {
+      // The value of a SIZE=<n> parameter (RFC 1870), if there is one.
+      KJ_IF_MAYBE(value, mailParameter(params, "size=")) {
+        return parseUInt(*value);
+      }
+      return nullptr;
+    }
+
+    static bool isBinaryMime(kj::ArrayPtr<const char> params) {
+      // Whether the sender declared BODY=BINARYMIME (RFC 3030), which only BDAT can carry.
+      KJ_IF_MAYBE(value, mailParameter(params, "body=")) {
+        return value->size() == 10 && strncasecmp(value->begin(), "binarymime", 10) == 0;
+      }
+      return false;
+    }
+
+    void finishTransaction() {
+      // Back to the state after HELO/EHLO, ready for the next MAIL. The receive buffer and read
+      // size go back to their starting sizes too, so that a connection sitting idle after a
+      // large message doesn't keep the memory it needed for it.
+      envelope.clear();
+      bdatMessage = nullptr;
+      binaryMime = false;
+      state = SessionState::GREETED;
+      readSize = MIN_READ_SIZE;
+      input.shrink();
+    }
+
+    bool checkState(SessionState required) {
+      // Replies with the right 503 and returns false if the session isn't in `required`.
+      if (state == required) {
+        return true;
+      }
+      if (state == SessionState::CONNECTED) {
+        reply(STRING_AND_SIZE("503 5.5.1 Send HELO/EHLO first"));
+      } else if (required == SessionState::GREETED) {
+        reply(STRING_AND_SIZE("503 5.5.1 Nested MAIL command"));
+      } else if (required == SessionState::MAIL || state == SessionState::GREETED) {
+        reply(STRING_AND_SIZE("503 5.5.1 Need MAIL command"));
+      } else {
+        reply(STRING_AND_SIZE("503 5.5.1 Need RCPT command"));
+      }
+      return false;
+    }
+
+    kj::Promise<bool> handleBdat(kj::ArrayPtr<const char> args) {
+      // RFC 3030: BDAT <size> [LAST]. The chunk is the next <size> bytes after the command line.
+      args = trim(args);
+      kj::ArrayPtr<const char> sizeArg = args;
+      KJ_IF_MAYBE(first, splitFirst(args, ' ')) {
+        sizeArg = *first;
+        args = trim(args);
+      } else {
+        args = nullptr;
+      }
+      bool last = args.size() == 4 && strncasecmp(args.begin(), "last", 4) == 0;
+
+      KJ_IF_MAYBE(size, parseUInt(sizeArg)) {
+        // Whenever the size is readable the chunk has to be read past, even if it is refused,
+        // to keep the session in sync.
+        startData();
+        if (args.size() > 0 && !last) {
+          return skipChunk(*size).then([this]() {
+            reply(STRING_AND_SIZE("501 5.5.4 Syntax: BDAT <size> [LAST]"));
+            return true;
+          });
+        }
+
+        if (state != SessionState::RCPT) {
+          return skipChunk(*size).then([this]() {
+            checkState(SessionState::RCPT);
+            return true;
+          });
+        }
+
+        uint64_t received = 0;
+        KJ_IF_MAYBE(sink, bdatMessage) {
+          received = (*sink)->size();
+        }
+        if (*size > receiveOptions.maxMessageSize - received) {
+          // RFC 3030 §4.2: the transaction is over.
+          finishTransaction();
+          return skipChunk(*size).then([this]() {
+            reply(STRING_AND_SIZE("552 5.3.4 Message size exceeds fixed maximum message size"));
+            return true;
+          });
+        }
+
+        if (bdatMessage == nullptr) {
+          bdatMessage = kj::Own<MessageSink>(kj::heap<SpillingMessageSink>(receiveOptions));
+        }
+        MessageSink* sinkPtr = KJ_ASSERT_NONNULL(bdatMessage).get();
+        stageStart = nowNanos();
+        return readChunk(*sinkPtr, *size).then([this, last]() -> kj::Promise<bool> {
+          recordStage(Stage::DATA, stageStart);
+          if (!last) {
+            reply(STRING_AND_SIZE("250 2.0.0 Chunk received"));
+            return true;
+          }
+
+          auto sink = kj::mv(KJ_ASSERT_NONNULL(bdatMessage));
+          finishTransaction();
+          return deliverMessage(*sink).attach(kj::mv(sink)).then([]() {
+            return true;
+          });
+        });
+      } else {
+        reply(STRING_AND_SIZE("501 5.5.4 Syntax: BDAT <size> [LAST]"));
+        return true;
+      }
+    }
+
+    kj::Promise<bool> handleData() {
+      if (bdatMessage != nullptr) {
+        reply(STRING_AND_SIZE("503 5.5.1 DATA not allowed after BDAT"));
+        return true;
+      }
+      if (!checkState(SessionState::RCPT) || rejectIfQueueFull()) {
+        return true;
+      }
+      if (binaryMime) {
+        // RFC 3030 section 3: a BINARYMIME message can't be sent with DATA.
+        reply(STRING_AND_SIZE("503 5.5.1 BDAT required with BODY=BINARYMIME"));
+        return true;
+      }
+
+      // DATA ends a pipelined batch (RFC 2920), so everything queued so far goes out with the 354.
+      auto sink = kj::heap<SpillingMessageSink>(receiveOptions);
+      SpillingMessageSink* sinkPtr = sink.get();
+      reply(STRING_AND_SIZE("354 Start mail input; end with <CRLF>.<CRLF>"));
+      return flushReplies().then([this, sinkPtr]() {
+        stageStart = nowNanos();
+        startData();
+        return readData(*sinkPtr);
+      }).then([this, sinkPtr]() -> kj::Promise<void> {
+        recordStage(Stage::DATA, stageStart);
+        finishTransaction();
+        if (sinkPtr->isTooLarge()) {
+          reply(STRING_AND_SIZE("552 5.3.4 Message size exceeds fixed maximum message size"));
+          return kj::READY_NOW;
+        }
+        return deliverMessage(*sinkPtr);
+      }).attach(kj::mv(sink)).then([]() {
+        return true;
+      });
+    }
+
+    kj::Promise<bool> handleCommand(kj::ArrayPtr<const char> line) {
+      // `line` points into the receive buffer, so it must not be used after anything is read.
+      if (line.size() > 0 && line[line.size() - 1] == '\n') {
+        line = line.slice(0, line.size() - 1);
+      }
+      if (line.size() > 0 && line[line.size() - 1] == '\r') {
+        line = line.slice(0, line.size() - 1);
+      }
+      auto args = line.slice(kj::min(line.size(), size_t(4)), line.size());
+
+      switch (parseVerb(line)) {
+        case Verb::EHLO:
+          finishTransaction();
+          reply(ehloReply.begin(), ehloReply.size());
+          return true;
+
+        case Verb::HELO:
+          // TODO(someday): make sure hostname is passed as an argument
+          finishTransaction();
+          reply(STRING_AND_SIZE("250 Sandstorm at your service"));
+          return true;
+
+        case Verb::MAIL: {
+          if (!checkState(SessionState::GREETED)) {
+            return true;
+          }
+          kj::ArrayPtr<const char> params;
+          KJ_IF_MAYBE(path, parsePath(args, "from:", params)) {
+            KJ_IF_MAYBE(declared, sizeParameter(params)) {
+              if (*declared > receiveOptions.maxMessageSize) {
+                reply(STRING_AND_SIZE("552 5.3.4 Message size exceeds fixed maximum message size"));
+                return true;
+              }
+            }
+            if (!rejectIfQueueFull()) {
+              envelope.setSender(*path);
+              binaryMime = isBinaryMime(params);
+              state = SessionState::MAIL;
+              reply(STRING_AND_SIZE("250 2.1.0 OK"));
+            }
+          } else {
+            reply(STRING_AND_SIZE("501 5.5.4 Syntax: MAIL FROM:<address>"));
+          }
+          return true;
+        }
+
+        case Verb::RCPT: {
+          if (state != SessionState::RCPT && !checkState(SessionState::MAIL)) {
+            return true;
+          }
+          kj::ArrayPtr<const char> params;
+          KJ_IF_MAYBE(path, parsePath(args, "to:", params)) {
+            if (path->size() == 0) {
+              reply(STRING_AND_SIZE("501 5.1.3 Bad recipient address syntax"));
+            } else if (envelope.recipientCount() >= MAX_RECIPIENTS) {
+              reply(STRING_AND_SIZE("452 4.5.3 Too many recipients"));
+            } else {
+              envelope.addRecipient(*path);
+              state = SessionState::RCPT;
+              reply(STRING_AND_SIZE("250 2.1.5 OK"));
+            }
+          } else {
+            reply(STRING_AND_SIZE("501 5.5.4 Syntax: RCPT TO:<address>"));
+          }
+          return true;
+        }
+
+        case Verb::BDAT:
+          return handleBdat(args);
+
+        case Verb::DATA:
+          return handleData();
+
+        case Verb::RSET:
+          if (state != SessionState::CONNECTED) {
+            finishTransaction();
+          }
+          reply(STRING_AND_SIZE("250 OK"));
+          return true;
+
+        case Verb::NOOP:
+          reply(STRING_AND_SIZE("250 OK"));
+          return true;
+
+        case Verb::QUIT:
+          reply(STRING_AND_SIZE("221 2.0.0 Goodbye!"));
+          return false;
+
+        case Verb::UNKNOWN:
+          break;
+      }
+      reply(STRING_AND_SIZE("502 5.5.2 Error: command not recognized"));
+      return true;
+    }
+
+    kj::Promise<void> messageLoop() {
+      // A pipelining client may send a whole batch of commands at once. Their replies are queued
+      // and written in one go once no complete command is left in the buffer, i.e. right before
+      // we would otherwise wait on the client.
+      auto ready = hasPendingCommand() ? kj::Promise<void>(kj::READY_NOW) : flushReplies();
+      return ready.then([this]() {
+        stageStart = nowNanos();
+        startCommand();
+        return readUntil(END_LINE, MAX_COMMAND_LINE);
+      }).then(
+          [this](MaybeLine maybeLine) -> kj::Promise<void> {
+        recordStage(Stage::COMMAND, stageStart);
+        kj::ArrayPtr<const char> line;
+        KJ_IF_MAYBE(l, maybeLine) {
+          line = *l;
+        } else {
+          reply(STRING_AND_SIZE("500 5.5.2 Line too long"));
+          return messageLoop();
+        }
+        if (line.size() == 0) {
+          return kj::READY_NOW;
+        }
+        return handleCommand(line).then([this](bool continueLoop) -> kj::Promise<void> {
+          if (continueLoop) {
+            return messageLoop();
+          } else {
+            return flushReplies();
+          }
+        });
+      });
+    }
+  };
+
+  kj::AutoCloseFd listenSocket(uint32_t address, uint16_t port, bool reusePort = false) {
+    // Listens on the IPv4 `address`:`port` (host byte order); port 0 picks a free one. With
+    // `reusePort`, several sockets may share the port, e.g. one per worker thread.
+    int fd;
+    KJ_SYSCALL(fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd result(fd);
+
+    int one = 1;
+    KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+    if (reusePort) {
+      KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(address);
+    addr.sin_port = htons(port);
+    KJ_SYSCALL(bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+    KJ_SYSCALL(listen(fd, SOMAXCONN));
+    return result;
+  }
+
+  typedef std::array<uint8_t, 16> PeerAddress;
+  // A client's IP address, with IPv4 in its IPv4-mapped IPv6 form. All zeros for unix sockets.
+
+  class SocketListener {
+    // Accepts from a non-blocking listening socket itself rather than through
+    // kj::ConnectionReceiver, so that each client's address is known.
+
+  public:
+    struct Connection {
+      kj::Own<kj::AsyncIoStream> stream;
+      PeerAddress peer;
+    };
+
+    SocketListener(kj::UnixEventPort& eventPort, kj::LowLevelAsyncIoProvider& provider,
+                   kj::AutoCloseFd&& fdParam)
+        : provider(provider), fd(kj::mv(fdParam)),
+          observer(eventPort, fd, kj::UnixEventPort::FdObserver::OBSERVE_READ) {}
+
+    KJ_DISALLOW_COPY(SocketListener);
+
+    uint16_t getPort() {
+      struct sockaddr_in addr;
+      socklen_t size = sizeof(addr);
+      KJ_SYSCALL(getsockname(fd, reinterpret_cast<struct sockaddr*>(&addr), &size));
+      return ntohs(addr.sin_port);
+    }
+
+    kj::Promise<Connection> accept() {
+      struct sockaddr_storage addr;
+      socklen_t size = sizeof(addr);
+      int newFd = accept4(fd, reinterpret_cast<struct sockaddr*>(&addr), &size,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (newFd < 0) {
+        int error = errno;
+        switch (error) {
+          case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+          case EWOULDBLOCK:
+#endif
+            return observer.whenBecomesReadable().then([this]() {
+              return accept();
+            });
+
+          case EINTR:
+          case ECONNABORTED:
+          case ENETDOWN:
+          case EPROTO:
+          case EHOSTDOWN:
+          case EHOSTUNREACH:
+          case ENETUNREACH:
+          case ETIMEDOUT:
+            // The connection went away before we got to it; try the next one.
+            return accept();
+
+          default:
+            KJ_FAIL_SYSCALL("accept", error);
+        }
+      }
+
+      Connection result;
+      result.stream = provider.wrapSocketFd(newFd,
+          kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+          kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+          kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+      result.peer.fill(0);
+      if (addr.ss_family == AF_INET) {
+        auto& in = reinterpret_cast<struct sockaddr_in&>(addr);
+        result.peer[10] = 0xff;
+        result.peer[11] = 0xff;
+        memcpy(result.peer.data() + 12, &in.sin_addr, 4);
+      } else if (addr.ss_family == AF_INET6) {
+        auto& in6 = reinterpret_cast<struct sockaddr_in6&>(addr);
+        memcpy(result.peer.data(), &in6.sin6_addr, 16);
+      }
+      return kj::mv(result);
+    }
+
+  private:
+    kj::LowLevelAsyncIoProvider& provider;
+    kj::AutoCloseFd fd;
+    kj::UnixEventPort::FdObserver observer;
+  };
+
+  class SmtpServer final: private kj::TaskSet::ErrorHandler {
+    // Accepts connections and runs an SMTP session on each, within the limits of
+    // ReceiveOptions. At `maxConnections` it stops calling accept() at all, so waiting clients
+    // cost nothing here until a session ends. Must be used on one thread; with several threads,
+    // each has its own server and the limits apply to each separately.
+
+  public:
+    SmtpServer(MailQueue& deliveryQueue, const ReceiveOptions& receiveOptions, kj::Timer& timer)
+        : deliveryQueue(deliveryQueue), receiveOptions(receiveOptions), timer(timer),
+          tasks(*this) {}
+
+    KJ_DISALLOW_COPY(SmtpServer);
+
+    kj::Promise<void> listen(SocketListener& listener) {
+      // Accepts from `listener` forever.
+      if (receiveOptions.maxConnections > 0 && active >= receiveOptions.maxConnections) {
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        slotFreed = kj::mv(paf.fulfiller);
+        return paf.promise.then([this, &listener]() {
+          return listen(listener);
+        });
+      }
+
+      return listener.accept().then([this, &listener](SocketListener::Connection&& connection) {
+        admit(kj::mv(connection));
+        return listen(listener);
+      });
+    }
+
+  private:
+    class Slot {
+      // Held for as long as a session runs.
+    public:
+      Slot(SmtpServer& server, const PeerAddress& peer): server(server), peer(peer) {}
+      ~Slot() noexcept(false) { server.release(peer); }
+      KJ_DISALLOW_COPY(Slot);
+
+    private:
+      SmtpServer& server;
+      PeerAddress peer;
+    };
+
+    MailQueue& deliveryQueue;
+    const ReceiveOptions& receiveOptions;
+    kj::Timer& timer;
+    uint active = 0;
+    std::map<PeerAddress, uint> perAddress;
+    kj::Own<kj::PromiseFulfiller<void>> slotFreed;
+    kj::TaskSet tasks;
+    // Last, so sessions are torn down while the rest is still there for their Slots.
+
+    void admit(SocketListener::Connection&& connection) {
+      if (receiveOptions.maxConnectionsPerAddress > 0) {
+        uint& count = perAddress[connection.peer];
+        if (count >= receiveOptions.maxConnectionsPerAddress) {
+          countStat(Counter::REFUSED_CONNECTIONS);
+          auto& stream = *connection.stream;
+          tasks.add(stream.write(STRING_AND_SIZE("421 4.7.0 Too many connections from your address"))
+              .exclusiveJoin(timer.afterDelay(1 * kj::SECONDS))
+              .then([]() {}, [](kj::Exception&& exception) {})
+              .attach(kj::mv(connection.stream)));
+          return;
+        }
+        ++count;
+      }
+
+      ++active;
+      auto slot = kj::heap<Slot>(*this, connection.peer);
+      auto session = kj::heap<AcceptedConnection>(kj::mv(connection.stream), deliveryQueue,
+                                                  receiveOptions, timer);
+      auto promise = session->start();
+      tasks.add(promise.attach(kj::mv(session), kj::mv(slot)));
+    }
+
+    void release(const PeerAddress& peer) {
+      --active;
+      if (receiveOptions.maxConnectionsPerAddress > 0) {
+        auto iter = perAddress.find(peer);
+        if (iter != perAddress.end() && --iter->second == 0) {
+          perAddress.erase(iter);
+        }
+      }
+      if (slotFreed.get() != nullptr) {
+        slotFreed->fulfill();
+        slotFreed = nullptr;
+      }
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, "connection failed", exception);
+    }
+  };
 
   #undef STRING_AND_SIZE
   }  // namespace smtp
@@ -0,0 +1,262 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Recordings of what SMTP clients sent, read by read, for replaying through the bridge later
+// (see sandstorm-smtp-replay.c++, which plays them back with ReplayStream). A capture file is:
+//
+//   "SMTPCAP1"                  8 bytes
+//   start time                  8 bytes, little-endian nanoseconds since the epoch
+//   one record per read:
+//     delay                     varint, microseconds since the previous read (or the start)
+//     size                      varint, bytes returned by the read; 0 for end of stream
+//     data                      `size` bytes
+//
+// Varints are LEB128: 7 bits at a time, least significant first, high bit set on all but the
+// last byte.
+
+#pragma once
+
+#include <kj/array.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace sandstorm {
+  namespace smtp {
+
+  static const kj::byte CAPTURE_MAGIC[8] = { 'S', 'M', 'T', 'P', 'C', 'A', 'P', '1' };
+
+  class SessionCapture {
+    // Writes one connection's capture file. Capturing is best-effort: if the file can't be
+    // written, that is logged once and the session carries on without it.
+
+  public:
+    explicit SessionCapture(kj::StringPtr directory) {
+      static std::atomic<uint64_t> counter { 0 };
+      auto path = kj::str(directory, "/session-", getpid(), "-", counter.fetch_add(1), ".smtpcap");
+      int result;
+      KJ_SYSCALL(result = open(path.cStr(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600), path);
+      fd = kj::AutoCloseFd(result);
+
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      buffer.addAll(CAPTURE_MAGIC, CAPTURE_MAGIC + sizeof(CAPTURE_MAGIC));
+      uint64_t start = now.tv_sec * 1000000000ull + now.tv_nsec;
+      for (uint i = 0; i < 8; i++) {
+        buffer.add(start >> (i * 8));
+      }
+      last = monotonicNanos();
+    }
+
+    ~SessionCapture() noexcept(false) {
+      flush();
+    }
+
+    KJ_DISALLOW_COPY(SessionCapture);
+
+    void record(const void* data, size_t size) {
+      // Records one read that returned `size` bytes at `data`; 0 at end of stream.
+      if (fd.get() < 0) {
+        return;
+      }
+      uint64_t now = monotonicNanos();
+      addVarint((now - last) / 1000);
+      addVarint(size);
+      auto bytes = reinterpret_cast<const kj::byte*>(data);
+      buffer.addAll(bytes, bytes + size);
+      last = now;
+      if (buffer.size() >= FLUSH_SIZE) {
+        flush();
+      }
+    }
+
+  private:
+    static const size_t FLUSH_SIZE = 64 << 10;
+
+    kj::AutoCloseFd fd;
+    kj::Vector<kj::byte> buffer;
+    uint64_t last;
+
+    static uint64_t monotonicNanos() {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      return now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+
+    void addVarint(uint64_t value) {
+      while (value >= 0x80) {
+        buffer.add((value & 0x7f) | 0x80);
+        value >>= 7;
+      }
+      buffer.add(value);
+    }
+
+    void flush() {
+      if (fd.get() < 0 || buffer.size() == 0) {
+        return;
+      }
+      const kj::byte* pos = buffer.begin();
+      const kj::byte* end = buffer.end();
+      while (pos < end) {
+        ssize_t n = write(fd, pos, end - pos);
+        if (n < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          KJ_LOG(ERROR, "giving up on session capture", strerror(errno));
+          fd = kj::AutoCloseFd();
+          break;
+        }
+        pos += n;
+      }
+      buffer = kj::Vector<kj::byte>();
+    }
+  };
+
+  struct CapturedRead {
+    uint64_t offsetNanos;  // since the start of the session
+    kj::ArrayPtr<const kj::byte> data;
+  };
+
+  struct CapturedSession {
+    uint64_t startTime;  // nanoseconds since the epoch
+    kj::Array<kj::byte> content;
+    kj::Array<CapturedRead> reads;  // pointing into `content`
+  };
+
+  CapturedSession readCapture(kj::StringPtr path) {
+    int fdNumber;
+    KJ_SYSCALL(fdNumber = open(path.cStr(), O_RDONLY | O_CLOEXEC), path);
+    kj::AutoCloseFd fd(fdNumber);
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+
+    CapturedSession session;
+    session.content = kj::heapArray<kj::byte>(stats.st_size);
+    kj::FdInputStream(fd.get()).read(session.content.begin(), session.content.size());
+
+    const kj::byte* pos = session.content.begin();
+    const kj::byte* end = session.content.end();
+    KJ_REQUIRE(end - pos >= 16 && memcmp(pos, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) == 0,
+               "not a session capture", path);
+    pos += sizeof(CAPTURE_MAGIC);
+    session.startTime = 0;
+    for (uint i = 0; i < 8; i++) {
+      session.startTime |= uint64_t(*pos++) << (i * 8);
+    }
+
+    auto readVarint = [&]() {
+      uint64_t value = 0;
+      for (uint shift = 0;; shift += 7) {
+        KJ_REQUIRE(pos < end && shift < 64, "truncated session capture", path);
+        kj::byte b = *pos++;
+        value |= uint64_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+          return value;
+        }
+      }
+    };
+
+    kj::Vector<CapturedRead> reads;
+    uint64_t offset = 0;
+    while (pos < end) {
+      offset += readVarint() * 1000;
+      uint64_t size = readVarint();
+      KJ_REQUIRE(size <= uint64_t(end - pos), "truncated session capture", path);
+      reads.add(CapturedRead { offset, kj::arrayPtr(pos, size) });
+      pos += size;
+    }
+    session.reads = reads.releaseAsArray();
+    return session;
+  }
+
+  class ReplayStream final: public kj::AsyncIoStream {
+    // The client end of a captured session. Each tryRead() returns one recorded read (or what is
+    // left of it, if the buffer is smaller), once it is due. Writes are counted and dropped.
+
+  public:
+    ReplayStream(const CapturedSession& session, kj::Timer& timer,
+                 kj::Maybe<kj::TimePoint> origin, uint64_t& bytesWritten)
+        : reads(session.reads), timer(timer), origin(origin), bytesWritten(bytesWritten) {}
+
+    kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+      return readSome(static_cast<kj::byte*>(buffer), minBytes, maxBytes, 0);
+    }
+
+    kj::Promise<void> write(const void* buffer, size_t size) override {
+      bytesWritten += size;
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+      for (auto& piece: pieces) {
+        bytesWritten += piece.size();
+      }
+      return kj::READY_NOW;
+    }
+
+    void shutdownWrite() override {}
+
+  private:
+    kj::ArrayPtr<const CapturedRead> reads;
+    kj::Timer& timer;
+    kj::Maybe<kj::TimePoint> origin;  // null to replay at full speed
+    uint64_t& bytesWritten;
+    size_t index = 0;
+    size_t offset = 0;  // into reads[index]
+
+    kj::Promise<size_t> readSome(kj::byte* out, size_t minBytes, size_t maxBytes, size_t done) {
+      if (done >= minBytes || index == reads.size()) {
+        return done;
+      }
+      if (reads[index].data.size() == 0) {
+        // The client closed its end here.
+        index = reads.size();
+        return done;
+      }
+
+      kj::Promise<void> due = kj::READY_NOW;
+      if (offset == 0) {
+        KJ_IF_MAYBE(start, origin) {
+          due = timer.atTime(*start + int64_t(reads[index].offsetNanos) * kj::NANOSECONDS);
+        }
+      }
+      return due.then([this, out, minBytes, maxBytes, done]() {
+        auto data = reads[index].data;
+        size_t n = kj::min(data.size() - offset, maxBytes - done);
+        memcpy(out + done, data.begin() + offset, n);
+        offset += n;
+        if (offset == data.size()) {
+          ++index;
+          offset = 0;
+        }
+        return readSome(out, minBytes, maxBytes, done + n);
+      });
+    }
+  };
+
+  }  // namespace smtp
+}  // namespace sandstorm
@@ -0,0 +1,315 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// One-pass Content-Transfer-Encoding decoders used by the smtp bridge in place of GMime's
+// filter streams. Both decode a whole part from its raw bytes into a caller-provided buffer, and
+// produce the same output as g_mime_filter_basic given the whole part at once, malformed input
+// included.
+//
+// The base64 decoder converts 16 (SSE4.1) or 32 (AVX2) input bytes per step, chosen at runtime,
+// and drops to a scalar loop only around line breaks and other characters outside the alphabet.
+// The quoted-printable decoder copies 16 bytes at a time until it reaches an '='.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANDSTORM_SMTP_X86 1
+#endif
+
+namespace sandstorm {
+  namespace smtp {
+  namespace decode {
+
+  inline size_t base64DecodedSizeBound(size_t encodedSize) {
+    return encodedSize / 4 * 3 + 3;
+  }
+
+  inline size_t quotedPrintableDecodedSizeBound(size_t encodedSize) {
+    return encodedSize;
+  }
+
+  static const uint8_t BASE64_INVALID = 0xff;
+
+  struct Base64Rank {
+    // Maps a byte to its base64 value. As in GMime, '=' ranks as zero; trailing padding is
+    // accounted for once the whole input has been seen.
+    uint8_t table[256];
+
+    Base64Rank() {
+      memset(table, BASE64_INVALID, sizeof(table));
+      const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      for (uint8_t i = 0; i < 64; i++) {
+        table[(uint8_t)alphabet[i]] = i;
+      }
+      table['='] = 0;
+    }
+  };
+
+  inline const uint8_t* base64Rank() {
+    static const Base64Rank rank;
+    return rank.table;
+  }
+
+  typedef size_t Base64BlockDecoder(const uint8_t*& in, const uint8_t* inEnd,
+                                    uint8_t*& out, uint8_t* outEnd);
+  // Decodes whole blocks of alphabet characters, advancing `in` and `out`. Stops at the first
+  // block containing anything else and returns the number of valid characters at the start of
+  // that block, which the caller then decodes with the scalar loop along with the invalid one.
+
+  inline size_t decodeBase64BlocksScalar(const uint8_t*& in, const uint8_t* inEnd,
+                                         uint8_t*& out, uint8_t* outEnd) {
+    return 0;
+  }
+
+#if SANDSTORM_SMTP_X86
+  __attribute__((target("sse4.1")))
+  inline __m128i base64Values128(__m128i c, int& validMask) {
+    // Range-classifies 16 characters and converts them to their 6-bit values. Bytes >= 0x80 are
+    // negative under the signed compares and so fall outside every range.
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+    __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(_mm_or_si128(digit, plus), slash));
+    validMask = _mm_movemask_epi8(valid);
+
+    __m128i shift = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                     _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                     _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62 - '+')),
+                                  _mm_and_si128(slash, _mm_set1_epi8(63 - '/')))));
+    return _mm_add_epi8(c, shift);
+  }
+
+  __attribute__((target("sse4.1")))
+  inline __m128i base64Pack128(__m128i values) {
+    // Packs each group of four 6-bit values into three bytes, leaving 12 bytes at the front.
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(quads, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  }
+
+  __attribute__((target("sse4.1")))
+  inline size_t decodeBase64BlocksSse(const uint8_t*& in, const uint8_t* inEnd,
+                                      uint8_t*& out, uint8_t* outEnd) {
+    while (inEnd - in >= 16 && outEnd - out >= 16) {
+      int validMask;
+      __m128i values = base64Values128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), validMask);
+      if (validMask != 0xffff) {
+        return __builtin_ctz(~validMask);
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out), base64Pack128(values));
+      in += 16;
+      out += 12;
+    }
+    return 0;
+  }
+
+  __attribute__((target("avx2")))
+  inline size_t decodeBase64BlocksAvx2(const uint8_t*& in, const uint8_t* inEnd,
+                                       uint8_t*& out, uint8_t* outEnd) {
+    while (inEnd - in >= 32 && outEnd - out >= 32) {
+      __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+      __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+      __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+      __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                       _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+      __m256i plus = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+      __m256i slash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+
+      __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+                                      _mm256_or_si256(_mm256_or_si256(digit, plus), slash));
+      uint32_t validMask = _mm256_movemask_epi8(valid);
+      if (validMask != 0xffffffffu) {
+        return __builtin_ctz(~validMask);
+      }
+
+      __m256i shift = _mm256_or_si256(
+          _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                          _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+          _mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+                          _mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')),
+                                          _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')))));
+      __m256i values = _mm256_add_epi8(c, shift);
+
+      __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+      __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+      __m256i packed = _mm256_shuffle_epi8(quads, _mm256_setr_epi8(
+          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+      // Each 128-bit lane now holds 12 bytes at its front; close the gap between them.
+      packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+      in += 32;
+      out += 24;
+    }
+    // Let the SSE loop pick up a tail of 16..31 characters.
+    return decodeBase64BlocksSse(in, inEnd, out, outEnd);
+  }
+#endif
+
+  inline Base64BlockDecoder* chooseBase64BlockDecoder() {
+#if SANDSTORM_SMTP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return &decodeBase64BlocksAvx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+      return &decodeBase64BlocksSse;
+    }
+#endif
+    return &decodeBase64BlocksScalar;
+  }
+
+  inline size_t decodeBase64(const uint8_t* in, size_t size, uint8_t* out, size_t outSize,
+                             Base64BlockDecoder* blockDecoder = nullptr) {
+    // Decodes `size` bytes of base64 into `out`, which must hold at least
+    // base64DecodedSizeBound(size) bytes. Returns the number of bytes written. Characters
+    // outside the alphabet (line breaks, whitespace) are skipped and an incomplete final group
+    // is dropped, as GMime does. Like GMime, trailing '=' only takes bytes back off a complete
+    // final group.
+    static Base64BlockDecoder* const defaultBlockDecoder = chooseBase64BlockDecoder();
+    if (blockDecoder == nullptr) {
+      blockDecoder = defaultBlockDecoder;
+    }
+
+    const uint8_t* rank = base64Rank();
+    const uint8_t* inPtr = in;
+    const uint8_t* inEnd = in + size;
+    const uint8_t* scalarUntil = in;
+    uint8_t* outPtr = out;
+    uint8_t* outEnd = out + outSize;
+    uint32_t saved = 0;
+    int count = 0;
+
+    while (inPtr < inEnd) {
+      if (count == 0 && inPtr >= scalarUntil) {
+        size_t validPrefix = blockDecoder(inPtr, inEnd, outPtr, outEnd);
+        // Decode the rest of the block up to and including whatever stopped it one at a time.
+        scalarUntil = inPtr + validPrefix + 1;
+        if (inPtr >= inEnd) break;
+      }
+
+      uint8_t c = rank[*inPtr++];
+      if (c != BASE64_INVALID) {
+        saved = (saved << 6) | c;
+        if (++count == 4) {
+          *outPtr++ = (uint8_t)(saved >> 16);
+          *outPtr++ = (uint8_t)(saved >> 8);
+          *outPtr++ = (uint8_t)saved;
+          count = 0;
+        }
+      }
+    }
+
+    // Each '=' among the last two alphabet characters stands for one byte that wasn't there.
+    int remaining = count == 0 ? 2 : 0;
+    while (inPtr > in && remaining > 0) {
+      --inPtr;
+      if (rank[*inPtr] != BASE64_INVALID) {
+        if (*inPtr == '=' && outPtr > out) {
+          --outPtr;
+        }
+        --remaining;
+      }
+    }
+
+    return outPtr - out;
+  }
+
+  inline int hexValue(uint8_t c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    return -1;
+  }
+
+  inline const uint8_t* copyUntilEquals(const uint8_t* in, const uint8_t* inEnd, uint8_t*& out) {
+    // Copies bytes to `out` up to the next '=' and returns its position, or `inEnd`.
+#if SANDSTORM_SMTP_X86
+    const __m128i equals = _mm_set1_epi8('=');
+    while (inEnd - in >= 16) {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+      // The output never runs ahead of the input, so the whole block can be stored before
+      // knowing how much of it is literal.
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out), block);
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, equals));
+      if (mask != 0) {
+        int n = __builtin_ctz(mask);
+        out += n;
+        return in + n;
+      }
+      in += 16;
+      out += 16;
+    }
+#endif
+    const uint8_t* equalsPos = reinterpret_cast<const uint8_t*>(memchr(in, '=', inEnd - in));
+    const uint8_t* stop = equalsPos == nullptr ? inEnd : equalsPos;
+    memcpy(out, in, stop - in);
+    out += stop - in;
+    return stop;
+  }
+
+  inline size_t decodeQuotedPrintable(const uint8_t* in, size_t size, uint8_t* out) {
+    // Decodes `size` bytes of quoted-printable into `out`, which must hold at least `size`
+    // bytes and must not overlap `in`. Returns the number of bytes written. Soft line breaks
+    // ("=\r\n" or "=\n") are removed. As in GMime, any other '=' takes the two bytes after it
+    // along: a malformed escape is passed through as all three, and one cut short by the end of
+    // the input is dropped.
+    const uint8_t* inPtr = in;
+    const uint8_t* inEnd = in + size;
+    uint8_t* outPtr = out;
+
+    while (inPtr < inEnd) {
+      inPtr = copyUntilEquals(inPtr, inEnd, outPtr);
+      if (inPtr == inEnd) break;
+
+      // inPtr is at '='.
+      size_t left = inEnd - inPtr;
+      if (left >= 2 && inPtr[1] == '\n') {
+        inPtr += 2;
+      } else if (left < 3) {
+        break;
+      } else if (hexValue(inPtr[1]) >= 0 && hexValue(inPtr[2]) >= 0) {
+        *outPtr++ = (uint8_t)(hexValue(inPtr[1]) << 4 | hexValue(inPtr[2]));
+        inPtr += 3;
+      } else if (inPtr[1] == '\r' && inPtr[2] == '\n') {
+        inPtr += 3;
+      } else {
+        memcpy(outPtr, inPtr, 3);
+        outPtr += 3;
+        inPtr += 3;
+      }
+    }
+
+    return outPtr - out;
+  }
+
+  }  // namespace decode
+  }  // namespace smtp
+}  // namespace sandstorm
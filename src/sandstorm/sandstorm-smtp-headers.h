@@ -0,0 +1,345 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reads RFC 5322 header fields straight out of a raw message, for the handful of top-level
+// headers the smtp bridge forwards. Nothing is allocated: fields and their values are handed out
+// as pointers into the message, and a value is copied only if it is folded across lines, into a
+// buffer the caller provides.
+//
+// Field names are found by scanning 16 bytes at a time for ':' and '\n' together. Values are only
+// worth handing to an RFC 2047 decoder when needsDecoding() says so; plain ASCII, the common
+// case, can be used as is.
+
+#pragma once
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANDSTORM_SMTP_X86 1
+#endif
+
+namespace sandstorm {
+  namespace smtp {
+  namespace headers {
+
+  struct Field {
+    const char* name;
+    size_t nameSize;
+    const char* value;
+    size_t valueSize;
+    // Everything after the ':' up to the line ending that ends the field. Still folded, and
+    // possibly still ending in '\r'.
+  };
+
+  inline bool nameIs(const Field& field, const char* name) {
+    // Case-insensitive comparison of the field name with `name`.
+    size_t size = strlen(name);
+    return field.nameSize == size && strncasecmp(field.name, name, size) == 0;
+  }
+
+  inline const char* findColonOrNewline(const char* in, const char* end) {
+    // Returns the first ':' or '\n' in [in, end), or `end`.
+#if SANDSTORM_SMTP_X86
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - in >= 16) {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+      int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, colon),
+                                                _mm_cmpeq_epi8(block, newline)));
+      if (mask != 0) {
+        return in + __builtin_ctz(mask);
+      }
+      in += 16;
+    }
+#endif
+    while (in < end && *in != ':' && *in != '\n') {
+      ++in;
+    }
+    return in;
+  }
+
+  inline const char* findFieldEnd(const char* in, const char* end) {
+    // Returns the '\n' that ends the field starting at or before `in`, skipping line breaks
+    // followed by whitespace (folds), or `end`.
+    for (;;) {
+      const char* newline = reinterpret_cast<const char*>(memchr(in, '\n', end - in));
+      if (newline == nullptr) {
+        return end;
+      }
+      if (newline + 1 == end || (newline[1] != ' ' && newline[1] != '\t')) {
+        return newline;
+      }
+      in = newline + 1;
+    }
+  }
+
+  class FieldReader {
+    // Iterates over the header fields at the start of a raw message.
+
+  public:
+    FieldReader(const char* data, size_t size): pos(data), end(data + size) {}
+
+    bool next(Field& field) {
+      // Fills in the next field and returns true, or returns false at the blank line that ends the
+      // header (or the end of the data). Lines that aren't fields are skipped.
+      while (pos < end) {
+        if (*pos == '\n' || (*pos == '\r' && pos + 1 < end && pos[1] == '\n')) {
+          pos += *pos == '\n' ? 1 : 2;
+          end = pos;
+          return false;
+        }
+
+        const char* stop = findColonOrNewline(pos, end);
+        if (stop == end) {
+          pos = end;
+          return false;
+        }
+        if (*stop == '\n') {
+          // Not a field; a stray line from a broken message.
+          pos = stop + 1;
+          continue;
+        }
+
+        const char* nameEnd = stop;
+        while (nameEnd > pos && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) {
+          --nameEnd;
+        }
+        const char* valueEnd = findFieldEnd(stop + 1, end);
+        field.name = pos;
+        field.nameSize = nameEnd - pos;
+        field.value = stop + 1;
+        field.valueSize = valueEnd - (stop + 1);
+        pos = valueEnd == end ? end : valueEnd + 1;
+        return true;
+      }
+      return false;
+    }
+
+    const char* bodyStart() {
+      // Where the body begins, once next() has returned false.
+      return pos;
+    }
+
+  private:
+    const char* pos;
+    const char* end;
+  };
+
+  inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+
+  inline void trim(const char*& text, size_t& size) {
+    while (size > 0 && isSpace(*text)) {
+      ++text;
+      --size;
+    }
+    while (size > 0 && isSpace(text[size - 1])) {
+      --size;
+    }
+  }
+
+  inline const char* unfold(const char* value, size_t& size, char* scratch) {
+    // Returns `value` with folding line breaks removed and surrounding whitespace trimmed,
+    // updating `size`. Unfolded values point into `value`; folded ones are copied into
+    // `scratch`, which must hold `size` bytes.
+    trim(value, size);
+    if (memchr(value, '\n', size) == nullptr) {
+      return value;
+    }
+
+    char* out = scratch;
+    for (size_t i = 0; i < size; i++) {
+      if (value[i] == '\r' && i + 1 < size && value[i + 1] == '\n') {
+        continue;
+      }
+      if (value[i] != '\n') {
+        *out++ = value[i];
+      }
+    }
+    size = out - scratch;
+    return scratch;
+  }
+
+  inline const char* unescape(const char* value, size_t& size, char* scratch) {
+    // Returns `value` with each quoted-pair ("\\x") replaced by the character it quotes, updating
+    // `size`. As with unfold(), values without a backslash are returned as they are and others
+    // are copied into `scratch`, which must hold `size` bytes.
+    if (memchr(value, '\\', size) == nullptr) {
+      return value;
+    }
+
+    char* out = scratch;
+    for (size_t i = 0; i < size; i++) {
+      if (value[i] == '\\' && i + 1 < size) {
+        ++i;
+      }
+      *out++ = value[i];
+    }
+    size = out - scratch;
+    return scratch;
+  }
+
+  inline bool needsDecoding(const char* text, size_t size) {
+    // True if `text` contains an RFC 2047 encoded word ("=?") or any byte outside ASCII.
+#if SANDSTORM_SMTP_X86
+    const __m128i equals = _mm_set1_epi8('=');
+    const __m128i question = _mm_set1_epi8('?');
+    size_t i = 0;
+    while (size - i >= 17) {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+      __m128i nextBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + 1));
+      __m128i encodedWord = _mm_and_si128(_mm_cmpeq_epi8(block, equals),
+                                          _mm_cmpeq_epi8(nextBlock, question));
+      if (_mm_movemask_epi8(_mm_or_si128(encodedWord, block)) != 0) {
+        return true;
+      }
+      i += 16;
+    }
+    text += i;
+    size -= i;
+#endif
+    for (size_t i = 0; i < size; i++) {
+      if (static_cast<uint8_t>(text[i]) >= 0x80 || (text[i] == '=' && i + 1 < size && text[i + 1] == '?')) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename Func>
+  void parseAddressList(const char* text, size_t size, Func&& func) {
+    // Splits an address list such as `"Doe, Jane" <jane@example.com>, bob@example.com` and calls
+    // func(name, nameSize, address, addressSize) for each mailbox, in order. Names have their
+    // surrounding quotes and any backslash escapes removed, and may be empty. Group syntax ("team: a@b, c@d;") is flattened
+    // into its members. Comments in parentheses are skipped over when looking for separators and
+    // left out of bare addresses; as GMime does, a comment next to a bare address
+    // ("jane@example.com (Jane Doe)") serves as its name if there is no other.
+    const char* end = text + size;
+    const char* itemStart = text;
+    const char* angleOpen = nullptr;
+    const char* angleClose = nullptr;
+    const char* commentOpen = nullptr;   // first top-level comment in the item
+    const char* commentClose = nullptr;
+    int commentDepth = 0;
+    bool quoted = false;
+
+    auto finish = [&](const char* itemEnd) {
+      const char* name = itemStart;
+      size_t nameSize = 0;
+      const char* address;
+      size_t addressSize;
+      if (angleOpen != nullptr) {
+        nameSize = angleOpen - itemStart;
+        address = angleOpen + 1;
+        addressSize = (angleClose != nullptr ? angleClose : itemEnd) - address;
+      } else if (commentOpen != nullptr && commentClose != nullptr) {
+        // The address is whichever side of the comment isn't blank.
+        address = itemStart;
+        addressSize = commentOpen - itemStart;
+        trim(address, addressSize);
+        if (addressSize == 0) {
+          address = commentClose + 1;
+          addressSize = itemEnd - address;
+        }
+        name = commentOpen + 1;
+        nameSize = commentClose - name;
+      } else {
+        address = itemStart;
+        addressSize = itemEnd - itemStart;
+      }
+      trim(name, nameSize);
+      trim(address, addressSize);
+      if (nameSize >= 2 && name[0] == '"' && name[nameSize - 1] == '"') {
+        ++name;
+        nameSize -= 2;
+      }
+      if (addressSize > 0) {
+        if (memchr(name, '\\', nameSize) == nullptr) {
+          func(name, nameSize, address, addressSize);
+        } else {
+          // Escaped names are rare enough that only they pay for a copy.
+          char small[128];
+          std::unique_ptr<char[]> large;
+          char* scratch = small;
+          if (nameSize > sizeof(small)) {
+            large.reset(new char[nameSize]);
+            scratch = large.get();
+          }
+          name = unescape(name, nameSize, scratch);
+          func(name, nameSize, address, addressSize);
+        }
+      }
+      itemStart = itemEnd + 1;
+      angleOpen = nullptr;
+      angleClose = nullptr;
+      commentOpen = nullptr;
+      commentClose = nullptr;
+    };
+
+    for (const char* p = text; p < end; ++p) {
+      char c = *p;
+      if (quoted) {
+        if (c == '\\' && p + 1 < end) {
+          ++p;
+        } else if (c == '"') {
+          quoted = false;
+        }
+      } else if (commentDepth > 0) {
+        if (c == '\\' && p + 1 < end) {
+          ++p;
+        } else if (c == '(') {
+          ++commentDepth;
+        } else if (c == ')') {
+          if (--commentDepth == 0 && commentOpen != nullptr && commentClose == nullptr) {
+            commentClose = p;
+          }
+        }
+      } else if (c == '"') {
+        quoted = true;
+      } else if (c == '(') {
+        ++commentDepth;
+        if (commentOpen == nullptr) {
+          commentOpen = p;
+        }
+      } else if (c == '<' && angleOpen == nullptr) {
+        angleOpen = p;
+      } else if (c == '>' && angleOpen != nullptr && angleClose == nullptr) {
+        angleClose = p;
+      } else if (angleOpen == nullptr || angleClose != nullptr) {
+        if (c == ',' || c == ';') {
+          finish(p);
+        } else if (c == ':' && angleOpen == nullptr) {
+          // The display name of a group; its members follow.
+          itemStart = p + 1;
+          commentOpen = nullptr;
+          commentClose = nullptr;
+        }
+      }
+    }
+    if (itemStart < end) {
+      finish(end);
+    }
+  }
+
+  }  // namespace headers
+  }  // namespace smtp
+}  // namespace sandstorm
@@ -0,0 +1,74 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A stand-in grain for the benchmark, replay and test tools, and the command-line bits they
+// share.
+
+#pragma once
+
+#include <kj/async-io.h>
+#include <kj/io.h>
+#include <kj/main.h>
+#include <sandstorm/email.capnp.h>
+#include <sandstorm/sandstorm-smtp-bridge.h>
+#include <unistd.h>
+
+namespace sandstorm {
+  namespace smtp {
+
+  class MockEmailSendPort final: public EmailSendPort::Server {
+    // Accepts every message, optionally after a delay, like a grain that takes a while to answer.
+
+  public:
+    MockEmailSendPort(kj::Timer& timer, uint latencyMs): timer(timer), latencyMs(latencyMs) {}
+
+    kj::Promise<void> send(SendContext context) override {
+      received++;
+      receivedWords += context.getParams().getEmail().totalSize().wordCount;
+      context.releaseParams();
+      if (latencyMs == 0) {
+        return kj::READY_NOW;
+      }
+      return timer.afterDelay(latencyMs * kj::MILLISECONDS);
+    }
+
+    uint64_t received = 0;
+    uint64_t receivedWords = 0;
+
+  private:
+    kj::Timer& timer;
+    uint latencyMs;
+  };
+
+  inline void printLine(kj::StringPtr line) {
+    // Writes `line` and a newline to stdout.
+    auto text = kj::str(line, '\n');
+    kj::FdOutputStream(STDOUT_FILENO).write(text.begin(), text.size());
+  }
+
+  inline kj::MainBuilder::Validity parseLatency(kj::StringPtr arg, uint& latencyMs) {
+    // For a --latency option giving MockEmailSendPort's delay.
+    KJ_IF_MAYBE(ms, parseUInt(arg)) {
+      if (*ms <= 60000) {
+        latencyMs = *ms;
+        return true;
+      }
+    }
+    return "must be a number of milliseconds up to 60000";
+  }
+
+  }  // namespace smtp
+}  // namespace sandstorm
@@ -0,0 +1,307 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <kj/function.h>
+#include <kj/mutex.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sandstorm {
+  namespace smtp {
+
+  template <typename T>
+  class CrossThreadQueue {
+    // Passes values from any thread to the event loop of one receiving thread. Senders append
+    // under a lock and only poke the receiver's pipe when the queue goes from empty to non-empty,
+    // so a burst of sends costs a single wakeup.
+
+  public:
+    CrossThreadQueue() {
+      int fds[2];
+      KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+      readEnd = kj::AutoCloseFd(fds[0]);
+      writeEnd = kj::AutoCloseFd(fds[1]);
+    }
+
+    KJ_DISALLOW_COPY(CrossThreadQueue);
+
+    void bind(kj::LowLevelAsyncIoProvider& provider) {
+      // Must be called on the receiving thread before receive().
+      wakeups = provider.wrapInputFd(readEnd);
+    }
+
+    void send(T&& value) {
+      // Safe to call from any thread.
+      bool wasEmpty;
+      {
+        auto lock = items.lockExclusive();
+        wasEmpty = lock->size() == 0;
+        lock->add(kj::mv(value));
+      }
+      if (wasEmpty) {
+        char c = 0;
+        KJ_SYSCALL(write(writeEnd, &c, 1));
+      }
+    }
+
+    kj::Promise<kj::Vector<T>> receive() {
+      // Resolves with everything sent since the last call, in order.
+      KJ_REQUIRE(wakeups.get() != nullptr, "bind() not called");
+      return wakeups->tryRead(buffer, 1, sizeof(buffer)).then([this](size_t n) {
+        KJ_ASSERT(n > 0, "cross-thread queue closed");
+        auto lock = items.lockExclusive();
+        auto result = kj::mv(*lock);
+        *lock = kj::Vector<T>();
+        return result;
+      });
+    }
+
+  private:
+    kj::MutexGuarded<kj::Vector<T>> items;
+    kj::AutoCloseFd readEnd;
+    kj::AutoCloseFd writeEnd;
+    kj::Own<kj::AsyncInputStream> wakeups;
+    char buffer[64];
+  };
+
+  class DecodeClient;
+
+  class DecodePool {
+    // A fixed set of threads for decoding the large parts of messages side by side. Event loops
+    // hand it batches of jobs through a DecodeClient and carry on; the pool thread that finishes
+    // the last job of a batch wakes the loop that submitted it. The pool may be shared by any
+    // number of threads.
+
+  public:
+    explicit DecodePool(uint threadCount) {
+      KJ_REQUIRE(threadCount > 0);
+      auto builder = kj::heapArrayBuilder<kj::Own<kj::Thread>>(threadCount);
+      for (uint i = 0; i < threadCount; i++) {
+        builder.add(kj::heap<kj::Thread>([this]() { workerLoop(); }));
+      }
+      threads = builder.finish();
+    }
+
+    ~DecodePool() noexcept(false) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      workAvailable.notify_all();
+      threads = nullptr;  // joins
+    }
+
+    KJ_DISALLOW_COPY(DecodePool);
+
+  private:
+    struct Batch {
+      kj::Array<kj::Function<void()>> jobs;
+      kj::Array<kj::Maybe<kj::Exception>> errors;
+      CrossThreadQueue<uint64_t>& finished;
+      uint64_t id;
+      std::atomic<size_t> next { 0 };
+      uint helpers = 0;   // pool threads working on this batch; guarded by the pool's mutex
+      bool done = false;  // every job has run; guarded by the pool's mutex
+
+      Batch(kj::Array<kj::Function<void()>>&& jobs, CrossThreadQueue<uint64_t>& finished,
+            uint64_t id)
+          : jobs(kj::mv(jobs)), errors(kj::heapArray<kj::Maybe<kj::Exception>>(this->jobs.size())),
+            finished(finished), id(id) {}
+
+      void work() {
+        for (;;) {
+          size_t i = next.fetch_add(1);
+          if (i >= jobs.size()) {
+            return;
+          }
+          errors[i] = kj::runCatchingExceptions([&]() { jobs[i](); });
+        }
+      }
+
+      bool claimed() {
+        return next.load() >= jobs.size();
+      }
+    };
+
+    kj::Array<kj::Own<kj::Thread>> threads;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable batchDone;
+    std::deque<Batch*> batches;
+    bool stopping = false;
+
+    friend class DecodeClient;
+
+    void submit(Batch& batch) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batches.push_back(&batch);
+      }
+      workAvailable.notify_all();
+    }
+
+    void wait(Batch& batch) {
+      // Blocks until every job in `batch` has run.
+      std::unique_lock<std::mutex> lock(mutex);
+      batchDone.wait(lock, [&]() { return batch.done; });
+    }
+
+    void workerLoop() {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        while (!batches.empty() && batches.front()->claimed()) {
+          batches.pop_front();
+        }
+        if (stopping) {
+          return;
+        }
+        if (batches.empty()) {
+          workAvailable.wait(lock);
+          continue;
+        }
+
+        // Only the last helper to leave a fully claimed batch completes it, so the batch can't go
+        // away while anyone is still inside work().
+        Batch* batch = batches.front();
+        ++batch->helpers;
+        lock.unlock();
+        batch->work();
+        lock.lock();
+        if (--batch->helpers == 0 && batch->claimed() && !batch->done) {
+          auto iter = std::find(batches.begin(), batches.end(), batch);
+          if (iter != batches.end()) {
+            batches.erase(iter);
+          }
+          batch->done = true;
+          // Still under the lock, so a waiting ~DecodeClient() can't free the queue under us.
+          batch->finished.send(uint64_t(batch->id));
+          batchDone.notify_all();
+        }
+      }
+    }
+  };
+
+  class DecodeClient final: private kj::TaskSet::ErrorHandler {
+    // One event loop's way into a DecodePool. Must be used only on the thread that constructed
+    // it.
+
+  public:
+    DecodeClient(DecodePool& pool, kj::LowLevelAsyncIoProvider& provider)
+        : pool(pool), tasks(*this) {
+      finished.bind(provider);
+      tasks.add(receiveFinished());
+    }
+
+    ~DecodeClient() noexcept(false) {
+      // Batches still running write into memory their callers own; wait them out.
+      for (auto& entry: pending) {
+        pool.wait(*entry.second.batch);
+      }
+    }
+
+    KJ_DISALLOW_COPY(DecodeClient);
+
+    kj::Promise<void> run(kj::Array<kj::Function<void()>>&& jobs) {
+      // Runs every job in `jobs` on the pool, in no particular order. Resolves once all are done,
+      // or breaks with the first exception (by index) if any threw. Whatever the jobs touch must
+      // stay put until then; if the promise is dropped early, dropping it waits for the jobs
+      // that are still running.
+      if (jobs.size() == 0) {
+        return kj::READY_NOW;
+      }
+      uint64_t id = nextId++;
+      auto batch = kj::heap<DecodePool::Batch>(kj::mv(jobs), finished, id);
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      DecodePool::Batch& batchRef = *batch;
+      pending.insert(std::make_pair(id, Pending { kj::mv(batch), kj::mv(paf.fulfiller) }));
+      pool.submit(batchRef);
+      return paf.promise.attach(kj::heap<CancelGuard>(*this, id));
+    }
+
+  private:
+    struct Pending {
+      kj::Own<DecodePool::Batch> batch;
+      kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    };
+
+    class CancelGuard {
+    public:
+      CancelGuard(DecodeClient& client, uint64_t id): client(client), id(id) {}
+      KJ_DISALLOW_COPY(CancelGuard);
+
+      ~CancelGuard() noexcept(false) {
+        auto iter = client.pending.find(id);
+        if (iter != client.pending.end()) {
+          client.pool.wait(*iter->second.batch);
+        }
+      }
+
+    private:
+      DecodeClient& client;
+      uint64_t id;
+    };
+
+    DecodePool& pool;
+    CrossThreadQueue<uint64_t> finished;
+    std::map<uint64_t, Pending> pending;
+    uint64_t nextId = 0;
+    kj::TaskSet tasks;
+
+    kj::Promise<void> receiveFinished() {
+      return finished.receive().then([this](kj::Vector<uint64_t>&& ids) {
+        for (auto id: ids) {
+          auto iter = pending.find(id);
+          KJ_ASSERT(iter != pending.end());
+          auto batch = kj::mv(iter->second.batch);
+          auto fulfiller = kj::mv(iter->second.fulfiller);
+          pending.erase(iter);
+
+          kj::Maybe<kj::Exception> error;
+          for (auto& jobError: batch->errors) {
+            KJ_IF_MAYBE(exception, jobError) {
+              error = kj::mv(*exception);
+              break;
+            }
+          }
+          KJ_IF_MAYBE(exception, error) {
+            fulfiller->reject(kj::mv(*exception));
+          } else {
+            fulfiller->fulfill();
+          }
+        }
+        return receiveFinished();
+      });
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, exception);
+    }
+  };
+
+  }  // namespace smtp
+}  // namespace sandstorm
@@ -0,0 +1,156 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replays SMTP sessions recorded with `sandstorm-smtp-bridge --capture-dir` through the bridge's
+// own session code, delivering to a mock EmailSendPort. Each session's server sees exactly the
+// reads the original client produced, split at the same places, either at the recorded times or
+// as fast as it asks for them. Reports throughput and the bridge's per-stage stats.
+
+// Hack around stdlib bug with C++14.
+#include <initializer_list>  // force libstdc++ to include its config
+#undef _GLIBCXX_HAVE_GETS    // correct broken config
+// End hack.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+
+#include <sandstorm/sandstorm-smtp-bridge.h>
+#include <sandstorm/sandstorm-smtp-capture.h>
+#include <sandstorm/sandstorm-smtp-mock.h>
+
+namespace sandstorm {
+
+typedef unsigned int uint;
+
+class SmtpReplayMain {
+public:
+  SmtpReplayMain(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "sandstorm-smtp-replay version: 0.0.1",
+                           "Replay SMTP sessions captured with sandstorm-smtp-bridge --capture-dir "
+                           "through the bridge's SMTP code, delivering to a mock grain.")
+        .addOption({"max-speed"}, KJ_BIND_METHOD(*this, setMaxSpeed),
+            "Give each session its data as soon as it is asked for, rather than at the times it "
+            "originally arrived.")
+        .addOptionWithArg({"repeat"}, KJ_BIND_METHOD(*this, setRepeat), "<count>",
+            "Replay the whole set of captures <count> times in a row. Default: 1.")
+        .addOptionWithArg({'l', "latency"}, KJ_BIND_METHOD(*this, setLatency), "<ms>",
+            "Make the mock grain take <ms> milliseconds to accept each message. Default: 0.")
+        .expectOneOrMoreArgs("<capture>", KJ_BIND_METHOD(*this, addCapture))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+  kj::MainBuilder::Validity setMaxSpeed() {
+    maxSpeed = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setRepeat(kj::StringPtr arg) {
+    KJ_IF_MAYBE(count, smtp::parseUInt(arg)) {
+      if (*count > 0 && *count <= 1000000) {
+        repeat = *count;
+        return true;
+      }
+    }
+    return "must be a number between 1 and 1000000";
+  }
+
+  kj::MainBuilder::Validity setLatency(kj::StringPtr arg) {
+    return smtp::parseLatency(arg, latencyMs);
+  }
+
+  kj::MainBuilder::Validity addCapture(kj::StringPtr path) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      captures.add(smtp::readCapture(path));
+    })) {
+      return kj::str(path, ": ", exception->getDescription());
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    auto io = kj::setupAsyncIo();
+    auto& timer = io.provider->getTimer();
+    auto mock = kj::heap<smtp::MockEmailSendPort>(timer, latencyMs);
+    auto& mockRef = *mock;
+    smtp::SingleSendPort grain(kj::mv(mock));
+
+    smtp::DeliveryOptions deliveryOptions;
+    deliveryOptions.maxQueuedBytes = UINT64_MAX;
+    smtp::DeliveryQueue queue(grain, deliveryOptions);
+    smtp::ReceiveOptions receiveOptions;
+
+    uint64_t earliest = UINT64_MAX;
+    uint64_t bytesRead = 0;
+    size_t readCount = 0;
+    for (auto& session: captures) {
+      earliest = kj::min(earliest, session.startTime);
+      for (auto& read: session.reads) {
+        bytesRead += read.data.size();
+      }
+      readCount += session.reads.size();
+    }
+
+    uint64_t bytesWritten = 0;
+    uint64_t began = smtp::nowNanos();
+    for (uint round = 0; round < repeat; round++) {
+      // Sessions keep their original offsets from one another unless replaying at full speed.
+      kj::TimePoint origin = timer.now();
+      kj::Vector<kj::Promise<void>> sessions;
+      for (auto& session: captures) {
+        kj::Maybe<kj::TimePoint> start;
+        if (!maxSpeed) {
+          start = origin + int64_t(session.startTime - earliest) * kj::NANOSECONDS;
+        }
+        auto stream = kj::heap<smtp::ReplayStream>(session, timer, start, bytesWritten);
+        auto connection = kj::heap<smtp::AcceptedConnection>(kj::mv(stream), queue,
+                                                             receiveOptions, timer);
+        auto promise = connection->start();
+        sessions.add(promise.attach(kj::mv(connection)));
+      }
+      kj::joinPromises(sessions.releaseAsArray()).wait(io.waitScope);
+    }
+
+    queue.whenIdle().wait(io.waitScope);
+    double seconds = (smtp::nowNanos() - began) / 1e9;
+
+    auto& stats = queue.getStats();
+    smtp::printLine(kj::str(
+        captures.size(), " sessions x ", repeat, ", ", readCount * repeat, " reads, ",
+        bytesRead * repeat / 1024, " KiB in, ", bytesWritten / 1024, " KiB of replies, ",
+        maxSpeed ? "full speed" : "original timing"));
+    smtp::printLine(kj::str(
+        seconds, " s: ", stats.delivered, " delivered, ", stats.failed, " failed, ",
+        stats.rejected, " rejected, ", mockRef.received / seconds, " msgs/s, ",
+        bytesRead * repeat / seconds / (1 << 20), " MiB/s"));
+    smtp::printLine(smtp::globalStats().format());
+    return true;
+  }
+
+private:
+  kj::ProcessContext& context;
+  bool maxSpeed = false;
+  uint repeat = 1;
+  uint latencyMs = 0;
+  kj::Vector<smtp::CapturedSession> captures;
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::SmtpReplayMain)
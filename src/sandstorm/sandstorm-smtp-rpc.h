@@ -0,0 +1,184 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Connections from the smtp bridge to the grain's EmailSendPort, through sandstorm-api.
+
+#pragma once
+
+#include <sandstorm/sandstorm-smtp-bridge.h>
+#include <capnp/rpc-twoparty.h>
+#include <capnp/rpc.capnp.h>
+
+namespace sandstorm {
+  namespace smtp {
+
+  static constexpr kj::Duration MIN_RECONNECT_DELAY = 100 * kj::MILLISECONDS;
+  static constexpr kj::Duration MAX_RECONNECT_DELAY = 30 * kj::SECONDS;
+
+  class GrainConnectionPool final: public SendPortProvider, private kj::TaskSet::ErrorHandler {
+    // Keeps `size` separate RPC connections to sandstorm-api, each with its own restored
+    // EmailSendPort, and spreads sends across them: each goes to the live connection with the
+    // fewest bytes in flight, so a large message on one connection doesn't hold up small ones
+    // behind it. A connection that breaks, or whose EmailSendPort fails to restore, is set up
+    // again after a delay that starts at MIN_RECONNECT_DELAY and doubles with each failure in a
+    // row up to MAX_RECONNECT_DELAY. Only a message delivered over a connection shows it works
+    // and resets the delay; one that accepts and then drops every send keeps backing off. Sends
+    // wait while no connection is up.
+
+  public:
+    GrainConnectionPool(kj::AsyncIoProvider& provider, kj::StringPtr address, uint size)
+        : provider(provider), address(kj::heapString(address)), tasks(*this) {
+      KJ_REQUIRE(size > 0);
+      auto builder = kj::heapArrayBuilder<kj::Own<Slot>>(size);
+      for (uint i = 0; i < size; i++) {
+        builder.add(kj::heap<Slot>());
+      }
+      slots = builder.finish();
+      for (auto& slot: slots) {
+        connect(*slot);
+      }
+    }
+
+    KJ_DISALLOW_COPY(GrainConnectionPool);
+
+    kj::Promise<kj::Own<SendPortLease>> acquire(uint64_t size) override {
+      Slot* best = nullptr;
+      for (auto& slot: slots) {
+        if (slot->cap != nullptr &&
+            (best == nullptr || slot->bytesInFlight < best->bytesInFlight)) {
+          best = slot.get();
+        }
+      }
+      if (best != nullptr) {
+        return kj::Own<SendPortLease>(kj::heap<Lease>(*best, size));
+      }
+
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      waiting.add(kj::mv(paf.fulfiller));
+      return paf.promise.then([this, size]() {
+        return acquire(size);
+      });
+    }
+
+  private:
+    struct Slot {
+      // Declared in the order they depend on each other, so they are torn down in reverse.
+      kj::Own<kj::AsyncIoStream> stream;
+      kj::Own<capnp::TwoPartyVatNetwork> network;
+      kj::Own<capnp::RpcSystem<capnp::rpc::twoparty::SturdyRefHostId>> rpcSystem;
+      kj::Maybe<EmailSendPort::Client> cap;  // set while the connection is up
+      uint64_t bytesInFlight = 0;
+      kj::Duration backoff = MIN_RECONNECT_DELAY;
+      uint generation = 0;  // bumped on each connect, so old leases can't vouch for a new one
+    };
+
+    class Lease final: public SendPortLease {
+    public:
+      Lease(Slot& slot, uint64_t size)
+          : slot(slot), size(size), generation(slot.generation), cap(KJ_ASSERT_NONNULL(slot.cap)) {
+        slot.bytesInFlight += size;
+      }
+      ~Lease() noexcept(false) {
+        slot.bytesInFlight -= size;
+      }
+      KJ_DISALLOW_COPY(Lease);
+
+      EmailSendPort::Client& getCap() override { return cap; }
+
+      void delivered() override {
+        if (slot.generation == generation) {
+          slot.backoff = MIN_RECONNECT_DELAY;
+        }
+      }
+
+    private:
+      Slot& slot;
+      uint64_t size;
+      uint generation;
+      EmailSendPort::Client cap;
+      // Our own reference, so the send can finish (or fail) even if the slot reconnects first.
+    };
+
+    kj::AsyncIoProvider& provider;
+    kj::String address;
+    kj::Array<kj::Own<Slot>> slots;
+    kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waiting;
+    kj::TaskSet tasks;
+
+    void connect(Slot& slot) {
+      Slot* slotPtr = &slot;
+      tasks.add(provider.getNetwork().parseAddress(address).then([](kj::Own<kj::NetworkAddress>&& addr) {
+        return addr->connect();
+      }).then([this, slotPtr](kj::Own<kj::AsyncIoStream>&& stream) {
+        Slot& slot = *slotPtr;
+        ++slot.generation;
+        slot.stream = kj::mv(stream);
+        slot.network = kj::heap<capnp::TwoPartyVatNetwork>(*slot.stream, capnp::rpc::twoparty::Side::CLIENT);
+        slot.rpcSystem = kj::heap<capnp::RpcSystem<capnp::rpc::twoparty::SturdyRefHostId>>(
+            capnp::makeRpcClient(*slot.network));
+
+        capnp::MallocMessageBuilder message;
+        auto hostIdOrphan = message.getOrphanage().newOrphan<capnp::rpc::twoparty::SturdyRefHostId>();
+        auto hostId = hostIdOrphan.get();
+        auto objectId = message.getRoot<capnp::AnyPointer>();
+        hostId.setSide(capnp::rpc::twoparty::Side::SERVER);
+        objectId.setAs<capnp::Text>("HackSessionContext");
+        auto cap = slot.rpcSystem->restore(hostId, objectId).castAs<EmailSendPort>();
+
+        // Only offered to senders once the restore has gone through. If it fails, this is a
+        // failed connection like any other and is retried with backoff.
+        auto resolved = cap.whenResolved();
+        return resolved.then([this, slotPtr, cap = kj::mv(cap)]() mutable {
+          slotPtr->cap = kj::mv(cap);
+
+          for (auto& fulfiller: waiting) {
+            fulfiller->fulfill();
+          }
+          waiting = kj::Vector<kj::Own<kj::PromiseFulfiller<void>>>();
+
+          return slotPtr->network->onDisconnect();
+        });
+      }).then([slotPtr]() {
+        KJ_LOG(WARNING, "connection to sandstorm-api lost; reconnecting");
+        slotPtr->cap = nullptr;
+      }, [slotPtr](kj::Exception&& exception) {
+        KJ_LOG(ERROR, "couldn't connect to sandstorm-api", exception);
+        slotPtr->cap = nullptr;
+      }).then([this, slotPtr]() {
+        return reconnectLater(*slotPtr);
+      }));
+    }
+
+    kj::Promise<void> reconnectLater(Slot& slot) {
+      kj::Duration delay = slot.backoff;
+      slot.backoff = kj::min(slot.backoff * 2, MAX_RECONNECT_DELAY);
+      Slot* slotPtr = &slot;
+      return provider.getTimer().afterDelay(delay).then([this, slotPtr]() {
+        // Torn down here rather than in the onDisconnect() callback, which the network owns.
+        slotPtr->rpcSystem = nullptr;
+        slotPtr->network = nullptr;
+        slotPtr->stream = nullptr;
+        connect(*slotPtr);
+      });
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, "grain connection task failed", exception);
+    }
+  };
+
+  }  // namespace smtp
+}  // namespace sandstorm
@@ -0,0 +1,553 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Durable spool for mail the smtp bridge has accepted but not yet delivered to the grain.
+//
+// The spool is a directory of append-only segment files named segment-<n>, with <n> a 16-digit
+// hex counter. A segment is a sequence of records, each a SpoolRecordHeader followed by its payload
+// padded to 8 bytes:
+//
+// * MESSAGE records carry one raw message, exactly as received, under a sequence number that
+//   increases across segments.
+// * RETIRE records have no payload and mark the message with the same sequence number as
+//   delivered. They are appended to whichever segment is active at the time.
+//
+// A message is written once and fdatasync()ed before it is acknowledged. Syncs run on a
+// background thread, and every message appended while one is in progress is covered by the next,
+// so concurrent messages share one fdatasync() (group commit). Delivery maps the record back in
+// with mmap rather than keeping a copy in memory. Segments are deleted oldest first once every
+// message in them has been retired; going in order guarantees no RETIRE record is lost while
+// the message it refers to is still on disk. On startup recover() returns every message without
+// a RETIRE record, in sequence order. A record cut short by a crash was never acknowledged and
+// is ignored, as is everything after it in its segment. Each header carries a CRC-32C of itself
+// and the payload, so a record whose length made it to disk but whose contents didn't is caught
+// too. A write that fails part way is cut back off the segment before the next one.
+
+#pragma once
+
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/async-io.h>
+#include <kj/refcount.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <gmime/gmime.h>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANDSTORM_SMTP_X86 1
+#endif
+
+namespace sandstorm {
+  namespace smtp {
+
+  static const uint32_t SPOOL_RECORD_MAGIC = 0x4c505353;  // "SSPL"
+  static const uint64_t SPOOL_SEGMENT_SIZE = 64ull << 20;
+  // A new segment is started once the active one reaches this size.
+
+  struct SpoolRecordHeader {
+    enum Type: uint32_t {
+      MESSAGE = 1,
+      RETIRE = 2
+    };
+
+    uint32_t magic;
+    Type type;
+    uint64_t sequence;
+    uint64_t length;
+    uint32_t checksum;  // spoolChecksum() of the header, with this field zero, and the payload
+    uint32_t reserved;
+  };
+
+  struct Crc32cTable {
+    // Byte-at-a-time table for CRC-32C (Castagnoli), the polynomial SSE4.2 computes in hardware.
+    uint32_t table[256];
+
+    Crc32cTable() {
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+          crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+        table[i] = crc;
+      }
+    }
+  };
+
+  inline uint32_t crc32cScalar(uint32_t crc, const kj::byte* data, size_t size) {
+    static const Crc32cTable crcTable;
+    for (size_t i = 0; i < size; i++) {
+      crc = crcTable.table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+  }
+
+#if SANDSTORM_SMTP_X86 && defined(__x86_64__)
+  __attribute__((target("sse4.2")))
+  inline uint32_t crc32cSse(uint32_t crc, const kj::byte* data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+      uint64_t word;
+      memcpy(&word, data, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+      data += 8;
+      size -= 8;
+    }
+    crc = crc64;
+    while (size > 0) {
+      crc = _mm_crc32_u8(crc, *data++);
+      --size;
+    }
+    return crc;
+  }
+#endif
+
+  inline uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+    // Continues the CRC-32C `crc` (0 to start) over `size` bytes at `data`.
+    typedef uint32_t Impl(uint32_t, const kj::byte*, size_t);
+    static Impl* const impl = []() -> Impl* {
+#if SANDSTORM_SMTP_X86 && defined(__x86_64__)
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("sse4.2")) {
+        return &crc32cSse;
+      }
+#endif
+      return &crc32cScalar;
+    }();
+    return ~impl(~crc, reinterpret_cast<const kj::byte*>(data), size);
+  }
+
+  inline uint32_t spoolChecksum(SpoolRecordHeader header, const void* payload) {
+    header.checksum = 0;
+    return crc32c(crc32c(0, &header, sizeof(header)), payload, header.length);
+  }
+
+  inline uint64_t spoolPadding(uint64_t length) {
+    return (8 - length % 8) % 8;
+  }
+
+  class SpoolSyncer final: private kj::TaskSet::ErrorHandler {
+    // Runs fdatasync() on a background thread so the event loop never waits on the disk.
+    // Requests travel to the thread over one pipe and completions come back over another; the
+    // thread drains every request that has piled up before each sync.
+
+  public:
+    explicit SpoolSyncer(kj::LowLevelAsyncIoProvider& provider): tasks(*this) {
+      int requestFds[2];
+      int doneFds[2];
+      KJ_SYSCALL(pipe2(requestFds, O_CLOEXEC));
+      KJ_SYSCALL(pipe2(doneFds, O_CLOEXEC));
+      requestRead = kj::AutoCloseFd(requestFds[0]);
+      requestWrite = kj::AutoCloseFd(requestFds[1]);
+      doneWrite = kj::AutoCloseFd(doneFds[1]);
+      done = provider.wrapInputFd(doneFds[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+      thread = kj::heap<kj::Thread>([this]() { run(); });
+      tasks.add(readCompletions());
+    }
+
+    ~SpoolSyncer() noexcept(false) {
+      // Closing the request pipe tells the thread to exit; destroying it joins.
+      requestWrite = kj::AutoCloseFd();
+      thread = nullptr;
+    }
+
+    KJ_DISALLOW_COPY(SpoolSyncer);
+
+    kj::Promise<void> sync(int fd) {
+      // Resolves once everything written to `fd` before this call is on disk.
+      Request request = { ++requestedGeneration, fd };
+      ssize_t n;
+      KJ_SYSCALL(n = write(requestWrite, &request, sizeof(request)));
+      KJ_ASSERT(n == sizeof(request));
+
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      waiters.add(Waiter { request.generation, kj::mv(paf.fulfiller) });
+      return kj::mv(paf.promise);
+    }
+
+  private:
+    struct Request {
+      uint64_t generation;
+      int64_t fd;
+    };
+
+    struct Waiter {
+      uint64_t generation;
+      kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    };
+
+    static const uint64_t SYNC_FAILED = 1ull << 63;
+
+    kj::AutoCloseFd requestRead;
+    kj::AutoCloseFd requestWrite;
+    kj::AutoCloseFd doneWrite;
+    kj::Own<kj::AsyncInputStream> done;
+    uint64_t requestedGeneration = 0;
+    kj::Vector<Waiter> waiters;
+    size_t firstWaiter = 0;
+    uint64_t completions[64];
+    kj::TaskSet tasks;
+    kj::Own<kj::Thread> thread;
+
+    void run() {
+      // Sync thread.
+      Request requests[64];
+      for (;;) {
+        ssize_t n;
+        KJ_SYSCALL(n = read(requestRead, requests, sizeof(requests)));
+        if (n == 0) {
+          return;
+        }
+
+        uint64_t generation = 0;
+        int synced[64];
+        size_t syncedCount = 0;
+        bool ok = true;
+        for (size_t i = 0; i < n / sizeof(Request); i++) {
+          generation = kj::max(generation, requests[i].generation);
+          int fd = requests[i].fd;
+          if (std::find(synced, synced + syncedCount, fd) != synced + syncedCount) {
+            continue;
+          }
+          synced[syncedCount++] = fd;
+          if (fdatasync(fd) < 0) {
+            KJ_LOG(ERROR, "fdatasync() failed on spool segment", strerror(errno));
+            ok = false;
+          }
+        }
+
+        uint64_t reply = ok ? generation : generation | SYNC_FAILED;
+        KJ_SYSCALL(write(doneWrite, &reply, sizeof(reply)));
+      }
+    }
+
+    kj::Promise<void> readCompletions() {
+      return done->tryRead(completions, sizeof(uint64_t), sizeof(completions)).then([this](size_t n) {
+        KJ_ASSERT(n > 0, "spool sync thread exited");
+        for (size_t i = 0; i < n / sizeof(uint64_t); i++) {
+          bool ok = (completions[i] & SYNC_FAILED) == 0;
+          uint64_t generation = completions[i] & ~SYNC_FAILED;
+          while (firstWaiter < waiters.size() && waiters[firstWaiter].generation <= generation) {
+            auto& fulfiller = waiters[firstWaiter++].fulfiller;
+            if (ok) {
+              fulfiller->fulfill();
+            } else {
+              fulfiller->reject(KJ_EXCEPTION(FAILED, "could not sync spooled message to disk"));
+            }
+          }
+        }
+        if (firstWaiter == waiters.size()) {
+          waiters = kj::Vector<Waiter>();
+          firstWaiter = 0;
+        }
+        return readCompletions();
+      });
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, exception);
+    }
+  };
+
+  class Spool;
+
+  class SpoolSegment final: public kj::Refcounted {
+  public:
+    SpoolSegment(kj::String path, kj::AutoCloseFd fd, uint64_t size)
+        : path(kj::mv(path)), fd(kj::mv(fd)), size(size) {}
+
+    kj::String path;
+    kj::AutoCloseFd fd;
+    uint64_t size;
+    uint liveMessages = 0;  // MESSAGE records not yet retired
+  };
+
+  class SpoolRecord {
+    // A message held in the spool. Dropping this without calling retire() leaves the message to
+    // be replayed on the next start.
+
+  public:
+    SpoolRecord(Spool& spool, kj::Own<SpoolSegment> segment, uint64_t sequence,
+                uint64_t offset, uint64_t length)
+        : spool(spool), segment(kj::mv(segment)), sequence(sequence), offset(offset),
+          length(length) {}
+
+    uint64_t size() { return length; }
+
+    GMimeStream* openStream() {
+      // Returns a new stream over the message, mapped straight from the segment file.
+      int fd;
+      KJ_SYSCALL(fd = dup(segment->fd));
+      auto stream = g_mime_stream_mmap_new_with_bounds(fd, PROT_READ, MAP_SHARED,
+                                                       offset, offset + length);
+      if (stream == nullptr) {
+        close(fd);
+        KJ_FAIL_SYSCALL("mmap(spool segment)", errno, segment->path);
+      }
+      return stream;
+    }
+
+    void retire();
+    // Records that the message was delivered. It will not be replayed.
+
+  private:
+    Spool& spool;
+    kj::Own<SpoolSegment> segment;
+    uint64_t sequence;
+    uint64_t offset;
+    uint64_t length;
+    bool retired = false;
+
+    friend class Spool;
+  };
+
+  class Spool {
+  public:
+    Spool(kj::StringPtr directory, kj::LowLevelAsyncIoProvider& provider)
+        : directory(kj::heapString(directory)), syncer(provider) {
+      int fd;
+      KJ_SYSCALL(fd = open(directory.cStr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC), directory);
+      directoryFd = kj::AutoCloseFd(fd);
+    }
+
+    KJ_DISALLOW_COPY(Spool);
+
+    kj::Array<kj::Own<SpoolRecord>> recover() {
+      // Reads the existing segments and returns every message not yet retired, oldest first.
+      // Must be called once, before append().
+      KJ_REQUIRE(!recovered, "spool already recovered");
+      recovered = true;
+
+      kj::Vector<kj::String> names;
+      DIR* dir = opendir(directory.cStr());
+      KJ_ASSERT(dir != nullptr, "opendir(spool)", directory, strerror(errno));
+      KJ_DEFER(closedir(dir));
+      while (struct dirent* entry = readdir(dir)) {
+        unsigned long long number;
+        int consumed = 0;
+        if (sscanf(entry->d_name, "segment-%16llx%n", &number, &consumed) == 1 &&
+            entry->d_name[consumed] == '\0') {
+          names.add(kj::heapString(entry->d_name));
+          nextSegmentNumber = kj::max(nextSegmentNumber, (uint64_t)number + 1);
+        }
+      }
+      // The names are zero-padded, so sorting them sorts the segments by age.
+      std::sort(names.begin(), names.end());
+
+      kj::Vector<kj::Own<SpoolRecord>> unfinished;
+      {
+        // Scoped so that retired records, which keep their segments referenced, are gone before
+        // deleteRetiredSegments().
+        kj::Vector<kj::Own<SpoolRecord>> messages;
+        kj::Vector<uint64_t> retiredSequences;
+        for (auto& name: names) {
+          auto path = kj::str(directory, '/', name);
+          int fd;
+          KJ_SYSCALL(fd = open(path.cStr(), O_RDONLY | O_CLOEXEC), path);
+          kj::AutoCloseFd ownFd(fd);
+          struct stat stats;
+          KJ_SYSCALL(fstat(fd, &stats), path);
+
+          auto segment = kj::refcounted<SpoolSegment>(kj::mv(path), kj::mv(ownFd), stats.st_size);
+          const kj::byte* contents = nullptr;
+          if (segment->size > 0) {
+            void* mapping = mmap(nullptr, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+              KJ_FAIL_SYSCALL("mmap(spool segment)", errno, segment->path);
+            }
+            contents = reinterpret_cast<const kj::byte*>(mapping);
+          }
+          KJ_DEFER(if (contents != nullptr) munmap(const_cast<kj::byte*>(contents), segment->size));
+
+          uint64_t offset = 0;
+          for (;;) {
+            SpoolRecordHeader header;
+            if (segment->size - offset < sizeof(header)) {
+              break;
+            }
+            memcpy(&header, contents + offset, sizeof(header));
+            uint64_t payloadOffset = offset + sizeof(header);
+            if (header.magic != SPOOL_RECORD_MAGIC ||
+                header.length > segment->size - payloadOffset) {
+              // End of the segment, or a record cut short by a crash.
+              break;
+            }
+            if (header.checksum != spoolChecksum(header, contents + payloadOffset)) {
+              KJ_LOG(WARNING, "torn spool record; ignoring the rest of the segment",
+                     segment->path, offset);
+              break;
+            }
+            if (header.type == SpoolRecordHeader::MESSAGE) {
+              messages.add(kj::heap<SpoolRecord>(*this, kj::addRef(*segment), header.sequence,
+                                                 payloadOffset, header.length));
+              ++segment->liveMessages;
+            } else if (header.type == SpoolRecordHeader::RETIRE) {
+              retiredSequences.add(header.sequence);
+            }
+            nextSequence = kj::max(nextSequence, header.sequence + 1);
+            offset = payloadOffset + header.length + spoolPadding(header.length);
+          }
+          segments.add(kj::mv(segment));
+        }
+
+        std::sort(retiredSequences.begin(), retiredSequences.end());
+        for (auto& message: messages) {
+          if (std::binary_search(retiredSequences.begin(), retiredSequences.end(), message->sequence)) {
+            message->retired = true;
+            --message->segment->liveMessages;
+          } else {
+            unfinished.add(kj::mv(message));
+          }
+        }
+      }
+      deleteRetiredSegments();
+
+      if (unfinished.size() > 0) {
+        KJ_LOG(INFO, "replaying spooled messages", unfinished.size());
+      }
+      return unfinished.releaseAsArray();
+    }
+
+    kj::Promise<kj::Own<SpoolRecord>> append(kj::ArrayPtr<const char> message) {
+      // Writes `message` to the active segment. Resolves once it is durable.
+      KJ_REQUIRE(recovered, "call recover() before appending to the spool");
+      if (active == nullptr || active->size >= SPOOL_SEGMENT_SIZE) {
+        startSegment();
+      }
+      SpoolSegment& segment = *active;
+
+      SpoolRecordHeader header = {
+        SPOOL_RECORD_MAGIC, SpoolRecordHeader::MESSAGE, nextSequence++, message.size(), 0, 0
+      };
+      uint64_t payloadOffset = segment.size + sizeof(header);
+      static const char zeros[8] = {0};
+      writeRecord(header, message, kj::arrayPtr(zeros, spoolPadding(message.size())));
+
+      auto record = kj::heap<SpoolRecord>(*this, kj::addRef(segment), header.sequence,
+                                          payloadOffset, message.size());
+      SpoolRecord* recordPtr = record.get();
+      ++segment.liveMessages;
+      return syncer.sync(segment.fd).then([]() {}, [recordPtr](kj::Exception&& exception) {
+        // The message won't be acknowledged, so the client will send it again. Make sure it
+        // isn't also replayed from the spool, as far as that's possible.
+        KJ_IF_MAYBE(retireException, kj::runCatchingExceptions([&]() { recordPtr->retire(); })) {
+          KJ_LOG(ERROR, "can't retire unsynced spool record", *retireException);
+        }
+        kj::throwFatalException(kj::mv(exception));
+      }).then([record = kj::mv(record)]() mutable {
+        return kj::mv(record);
+      });
+    }
+
+  private:
+    kj::String directory;
+    kj::AutoCloseFd directoryFd;
+    SpoolSyncer syncer;
+    bool recovered = false;
+    uint64_t nextSequence = 1;
+    uint64_t nextSegmentNumber = 0;
+    kj::Vector<kj::Own<SpoolSegment>> segments;  // oldest first; the last one is `active`
+    SpoolSegment* active = nullptr;
+
+    friend class SpoolRecord;
+
+    void startSegment() {
+      // Zero-padded so that segment names sort by age.
+      char name[32];
+      snprintf(name, sizeof(name), "segment-%016llx", (unsigned long long)nextSegmentNumber++);
+      auto path = kj::str(directory, '/', name);
+
+      int fd;
+      KJ_SYSCALL(fd = open(path.cStr(), O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600), path);
+      // Make the new file's directory entry durable before anything in it is relied upon.
+      KJ_SYSCALL(fsync(directoryFd));
+
+      segments.add(kj::refcounted<SpoolSegment>(kj::mv(path), kj::AutoCloseFd(fd), 0));
+      active = segments.back().get();
+      deleteRetiredSegments();
+    }
+
+    void writeRecord(SpoolRecordHeader& header, kj::ArrayPtr<const char> payload,
+                     kj::ArrayPtr<const char> padding) {
+      header.checksum = spoolChecksum(header, payload.begin());
+      kj::ArrayPtr<const kj::byte> pieces[3] = {
+        kj::arrayPtr(reinterpret_cast<const kj::byte*>(&header), sizeof(header)),
+        kj::arrayPtr(reinterpret_cast<const kj::byte*>(payload.begin()), payload.size()),
+        kj::arrayPtr(reinterpret_cast<const kj::byte*>(padding.begin()), padding.size())
+      };
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        kj::FdOutputStream(active->fd.get()).write(kj::arrayPtr(pieces, 3));
+      })) {
+        // Whatever part of the record did reach the file must go, or the next record would be
+        // written after it and lost on recovery. If it can't be cut off, leave the segment be.
+        if (ftruncate(active->fd, active->size) < 0) {
+          KJ_LOG(ERROR, "can't truncate spool segment after a failed write; starting a new one",
+                 active->path, strerror(errno));
+          active = nullptr;
+        }
+        kj::throwFatalException(kj::mv(*exception));
+      }
+      active->size += sizeof(header) + payload.size() + padding.size();
+    }
+
+    void retire(SpoolRecord& record) {
+      if (record.retired) return;
+
+      if (active == nullptr) {
+        startSegment();
+      }
+      SpoolRecordHeader header = {
+        SPOOL_RECORD_MAGIC, SpoolRecordHeader::RETIRE, record.sequence, 0, 0, 0
+      };
+      writeRecord(header, nullptr, nullptr);
+      record.retired = true;
+
+      --record.segment->liveMessages;
+      deleteRetiredSegments();
+    }
+
+    void deleteRetiredSegments() {
+      // Deletes leading segments whose messages have all been retired. Anything still mapped or
+      // referenced by a record stays readable until released.
+      size_t count = 0;
+      while (count < segments.size() && segments[count]->liveMessages == 0 &&
+             segments[count].get() != active) {
+        KJ_SYSCALL(unlink(segments[count]->path.cStr()), segments[count]->path);
+        ++count;
+      }
+      if (count > 0) {
+        kj::Vector<kj::Own<SpoolSegment>> remaining(segments.size() - count);
+        for (size_t i = count; i < segments.size(); i++) {
+          remaining.add(kj::mv(segments[i]));
+        }
+        segments = kj::mv(remaining);
+      }
+    }
+  };
+
+  inline void SpoolRecord::retire() {
+    spool.retire(*this);
+  }
+
+  }  // namespace smtp
+}  // namespace sandstorm
@@ -0,0 +1,283 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Latency histograms and counters for the stages a message goes through in the smtp bridge.
+//
+// Every thread records into its own ThreadStats, so recording is a couple of uncontended relaxed
+// atomic stores and never takes a lock. A reader (the stats dump) sums all threads' values
+// whenever it likes; it may see a sample's count before its sum, which only matters for the
+// sample in flight.
+//
+// Histograms are log-linear in the style of HdrHistogram: each power of two is split into 16
+// buckets, so any recorded value is known to within about 6% from 1ns to the full range of
+// uint64_t, in a fixed 8KB per histogram.
+
+#pragma once
+
+#include <kj/debug.h>
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+namespace sandstorm {
+  namespace smtp {
+
+  enum class Stage {
+    ACCEPT,   // connection accepted until the greeting is written
+    COMMAND,  // waiting for and reading one command line
+    DATA,     // receiving a DATA section or BDAT chunk
+    PARSE,    // parse_message()
+    DECODE,   // decoding bodies and attachments; one sample per attachment decoded on a helper
+    BUILD,    // building the EmailMessage, less the DECODE time on the event loop
+    SEND,     // EmailSendPort.send() round trip
+  };
+
+  static const uint STAGE_COUNT = 7;
+  static const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "accept", "command", "data", "parse", "decode", "build", "send",
+  };
+
+  enum class Counter {
+    BYTES_IN,
+    BYTES_OUT,
+    CONNECTIONS,          // accepted so far
+    ACTIVE_CONNECTIONS,
+    REFUSED_CONNECTIONS,  // turned away for their address having too many
+    TIMEOUTS,             // sessions cut off for a slow or stalled client
+  };
+
+  static const uint COUNTER_COUNT = 6;
+  static const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "bytes in", "bytes out", "connections", "active connections", "refused connections",
+    "timeouts",
+  };
+
+  inline uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  class Histogram {
+    // Single writer, any number of readers.
+
+  public:
+    static const uint SUB_BUCKETS = 16;
+    static const uint BUCKET_COUNT = (64 - 3) * SUB_BUCKETS;
+
+    static uint bucketFor(uint64_t value) {
+      if (value < SUB_BUCKETS) {
+        return value;
+      }
+      uint exponent = 63 - __builtin_clzll(value);
+      uint sub = (value >> (exponent - 4)) & (SUB_BUCKETS - 1);
+      return (exponent - 3) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t bucketMax(uint bucket) {
+      // The largest value that lands in `bucket`.
+      if (bucket < SUB_BUCKETS) {
+        return bucket;
+      }
+      uint exponent = bucket / SUB_BUCKETS + 3;
+      uint64_t lowest = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 4);
+      return lowest + (uint64_t(1) << (exponent - 4)) - 1;
+    }
+
+    void record(uint64_t value) {
+      // Only the owning thread writes, so plain load/store is enough and cheaper than an
+      // atomic add.
+      bump(counts[bucketFor(value)], 1);
+      bump(sum, value);
+      if (value > max.load(std::memory_order_relaxed)) {
+        max.store(value, std::memory_order_relaxed);
+      }
+    }
+
+    void addTo(uint64_t* totals, uint64_t& totalSum, uint64_t& totalMax) const {
+      for (uint i = 0; i < BUCKET_COUNT; i++) {
+        totals[i] += counts[i].load(std::memory_order_relaxed);
+      }
+      totalSum += sum.load(std::memory_order_relaxed);
+      totalMax = kj::max(totalMax, max.load(std::memory_order_relaxed));
+    }
+
+  private:
+    std::atomic<uint64_t> counts[BUCKET_COUNT] = {};
+    std::atomic<uint64_t> sum { 0 };
+    std::atomic<uint64_t> max { 0 };
+
+    static void bump(std::atomic<uint64_t>& cell, uint64_t amount) {
+      cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+  };
+
+  class ThreadStats {
+    // One thread's share of the process-wide stats. Get the calling thread's with threadStats().
+
+  public:
+    void record(Stage stage, uint64_t nanos) {
+      stages[static_cast<uint>(stage)].record(nanos);
+    }
+
+    void add(Counter counter, int64_t amount) {
+      auto& cell = counters[static_cast<uint>(counter)];
+      cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+  private:
+    Histogram stages[STAGE_COUNT];
+    std::atomic<int64_t> counters[COUNTER_COUNT] = {};
+
+    friend class StatsRegistry;
+  };
+
+  class StatsRegistry {
+    // Owns every thread's ThreadStats. Threads register on first use and their stats outlive
+    // them, so counts from a thread that has exited are still reported.
+
+  public:
+    ThreadStats& addThread() {
+      std::lock_guard<std::mutex> lock(mutex);
+      threads.add(kj::heap<ThreadStats>());
+      return *threads.back();
+    }
+
+    kj::String format() {
+      // A table of every stage's latency distribution in microseconds, then the counters, summed
+      // over all threads.
+      kj::Vector<kj::String> lines;
+      lines.add(kj::str("stage        count      mean       p50       p90       p99      "
+                        "p999       max (us)"));
+
+      auto totals = kj::heapArray<uint64_t>(Histogram::BUCKET_COUNT);
+      int64_t counterTotals[COUNTER_COUNT] = {};
+      for (uint stage = 0; stage < STAGE_COUNT; stage++) {
+        memset(totals.begin(), 0, totals.size() * sizeof(uint64_t));
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          for (auto& thread: threads) {
+            thread->stages[stage].addTo(totals.begin(), sum, max);
+          }
+        }
+
+        uint64_t count = 0;
+        for (auto n: totals) {
+          count += n;
+        }
+        lines.add(kj::str(
+            pad(STAGE_NAMES[stage], 8, true), pad(kj::str(count), 10),
+            pad(micros(count == 0 ? 0 : sum / count), 10),
+            pad(micros(percentile(totals, count, max, 0.5)), 10),
+            pad(micros(percentile(totals, count, max, 0.9)), 10),
+            pad(micros(percentile(totals, count, max, 0.99)), 10),
+            pad(micros(percentile(totals, count, max, 0.999)), 10),
+            pad(micros(max), 10)));
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& thread: threads) {
+          for (uint i = 0; i < COUNTER_COUNT; i++) {
+            counterTotals[i] += thread->counters[i].load(std::memory_order_relaxed);
+          }
+        }
+      }
+      for (uint i = 0; i < COUNTER_COUNT; i++) {
+        lines.add(kj::str(COUNTER_NAMES[i], ": ", counterTotals[i]));
+      }
+      return kj::str(kj::strArray(lines, "\n"), "\n");
+    }
+
+  private:
+    std::mutex mutex;
+    kj::Vector<kj::Own<ThreadStats>> threads;
+
+    static uint64_t percentile(kj::ArrayPtr<const uint64_t> totals, uint64_t count, uint64_t max,
+                               double fraction) {
+      // An upper bound on the value at `fraction`, never above the largest value seen.
+      uint64_t rank = count * fraction;
+      uint64_t seen = 0;
+      for (uint i = 0; i < totals.size(); i++) {
+        seen += totals[i];
+        if (seen > rank) {
+          return kj::min(Histogram::bucketMax(i), max);
+        }
+      }
+      return max;
+    }
+
+    static kj::String micros(uint64_t nanos) {
+      return kj::str(nanos / 1000, '.', (nanos / 100) % 10);
+    }
+
+    static kj::String pad(kj::StringPtr text, size_t width, bool left = false) {
+      // Aligns `text` in `width` columns, to the right unless `left`.
+      auto result = kj::heapString(kj::max(width, text.size()));
+      memset(result.begin(), ' ', result.size());
+      memcpy(left ? result.begin() : result.end() - text.size(), text.begin(), text.size());
+      return result;
+    }
+  };
+
+  inline StatsRegistry& globalStats() {
+    static StatsRegistry registry;
+    return registry;
+  }
+
+  inline ThreadStats& threadStats() {
+    static thread_local ThreadStats* stats = nullptr;
+    if (stats == nullptr) {
+      stats = &globalStats().addThread();
+    }
+    return *stats;
+  }
+
+  inline void recordStage(Stage stage, uint64_t startNanos) {
+    // Records the time from `startNanos` (from nowNanos()) until now.
+    threadStats().record(stage, nowNanos() - startNanos);
+  }
+
+  inline void countStat(Counter counter, int64_t amount = 1) {
+    threadStats().add(counter, amount);
+  }
+
+  class StageTimer {
+    // Times a synchronous stage: from construction until the end of the enclosing scope, less
+    // any time handed to exclude() for a nested stage that is recorded separately.
+
+  public:
+    explicit StageTimer(Stage stage): stage(stage), start(nowNanos()) {}
+    ~StageTimer() { threadStats().record(stage, nowNanos() - start - excluded); }
+    KJ_DISALLOW_COPY(StageTimer);
+
+    uint64_t elapsed() const { return nowNanos() - start; }
+    void exclude(uint64_t nanos) { excluded += nanos; }
+
+  private:
+    Stage stage;
+    uint64_t start;
+    uint64_t excluded = 0;
+  };
+
+  }  // namespace smtp
+}  // namespace sandstorm
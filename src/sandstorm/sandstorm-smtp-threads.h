@@ -0,0 +1,306 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Multi-threaded SMTP front end.
+//
+// Each worker thread runs its own event loop with its own listening socket, all bound to the same
+// port with SO_REUSEPORT so the kernel spreads connections across them. A worker handles the whole
+// SMTP session and converts each message into a standalone EmailMessage, then passes it to the
+// thread that owns the RPC connection to the grain. That thread copies it into a request and feeds
+// it through the usual DeliveryQueue. Nothing besides the finished message, the queue's fill level
+// and (with --ack-after-delivery) the delivery result crosses between threads.
+//
+// With a spool, the spool belongs to the RPC thread too. A worker then sends the raw message
+// instead, and acknowledges it only once the RPC thread reports it durable; the message is parsed
+// and converted there, when its turn for delivery comes, like any spooled message.
+
+#pragma once
+
+#include <sandstorm/sandstorm-smtp-bridge.h>
+#include <kj/mutex.h>
+#include <atomic>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace sandstorm {
+  namespace smtp {
+
+  class WorkerDeliveryHub final: private kj::TaskSet::ErrorHandler {
+    // The RPC thread's end of the front end: takes messages converted by the workers and feeds
+    // them to the DeliveryQueue. Everything not marked otherwise must be used on the RPC thread.
+
+  public:
+    struct Job {
+      uint worker;
+      uint64_t id;
+      bool wantsResult;
+      kj::Own<capnp::MallocMessageBuilder> email;
+      kj::Array<char> raw;  // instead of `email`, for the spool
+      uint64_t size;
+      MemoryCharge charge;
+    };
+
+    struct Result {
+      uint64_t id;
+      bool spooled;  // reports on writing a raw message to the spool rather than on delivery
+      kj::Maybe<kj::Exception> error;
+    };
+
+    WorkerDeliveryHub(DeliveryQueue& queue, uint workerCount, kj::LowLevelAsyncIoProvider& provider)
+        : queue(queue), spooling(queue.getSpooling() != nullptr), tasks(*this) {
+      auto builder = kj::heapArrayBuilder<kj::Own<CrossThreadQueue<Result>>>(workerCount);
+      for (uint i = 0; i < workerCount; i++) {
+        builder.add(kj::heap<CrossThreadQueue<Result>>());
+      }
+      results = builder.finish();
+      jobs.bind(provider);
+    }
+
+    KJ_DISALLOW_COPY(WorkerDeliveryHub);
+
+    kj::Promise<void> run() {
+      // Receives jobs forever.
+      return jobs.receive().then([this](kj::Vector<Job>&& batch) {
+        for (auto& job: batch) {
+          dispatch(kj::mv(job));
+        }
+        return run();
+      });
+    }
+
+    // The rest is safe to call from any thread.
+
+    const DeliveryOptions& getOptions() {
+      // Fixed once the queue exists.
+      return queue.getOptions();
+    }
+
+    bool isSpooling() {
+      // True if workers must submit raw messages, to be spooled before they are acknowledged.
+      return spooling;
+    }
+
+    bool isFull() {
+      return queuedBytes.load(std::memory_order_relaxed) >= queue.getOptions().maxQueuedBytes;
+    }
+
+    void countRejected() {
+      rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t getRejected() {
+      return rejected.load(std::memory_order_relaxed);
+    }
+
+    void submit(Job&& job) {
+      // `job.size` counts against the queue limit from here until delivery finishes, so messages
+      // still crossing between threads are included.
+      queuedBytes.fetch_add(job.size, std::memory_order_relaxed);
+      jobs.send(kj::mv(job));
+    }
+
+    CrossThreadQueue<Result>& getResults(uint worker) {
+      return *results[worker];
+    }
+
+  private:
+    DeliveryQueue& queue;
+    bool spooling;
+    CrossThreadQueue<Job> jobs;
+    kj::Array<kj::Own<CrossThreadQueue<Result>>> results;
+    std::atomic<uint64_t> queuedBytes { 0 };
+    std::atomic<uint64_t> rejected { 0 };
+    kj::TaskSet tasks;
+
+    void dispatch(Job&& job) {
+      auto& resultQueue = *results[job.worker];
+      uint64_t id = job.id;
+      uint64_t size = job.size;
+      bool wantsResult = job.wantsResult;
+      if (job.raw == nullptr) {
+        tasks.add(report(queue.enqueue(kj::mv(job.email), size, kj::mv(job.charge)),
+                         resultQueue, id, size, wantsResult));
+        return;
+      }
+
+      kj::Promise<SpoolingQueue::Spooled> spooled = nullptr;
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        spooled = KJ_ASSERT_NONNULL(queue.getSpooling()).append(job.raw);
+      })) {
+        spooled = kj::mv(*exception);
+      }
+      // The worker waits for this either way before it answers the client.
+      tasks.add(spooled.then([this, &resultQueue, id, size, wantsResult](
+          SpoolingQueue::Spooled&& spooled) {
+        resultQueue.send(Result { id, true, nullptr });
+        return report(kj::mv(spooled.delivered), resultQueue, id, size, wantsResult);
+      }, [this, &resultQueue, id, size](kj::Exception&& exception) -> kj::Promise<void> {
+        queuedBytes.fetch_sub(size, std::memory_order_relaxed);
+        resultQueue.send(Result { id, true, kj::mv(exception) });
+        return kj::READY_NOW;
+      }));
+    }
+
+    kj::Promise<void> report(kj::Promise<void>&& delivered, CrossThreadQueue<Result>& resultQueue,
+                             uint64_t id, uint64_t size, bool wantsResult) {
+      return delivered.then([this, &resultQueue, id, size, wantsResult]() {
+        queuedBytes.fetch_sub(size, std::memory_order_relaxed);
+        if (wantsResult) {
+          resultQueue.send(Result { id, false, nullptr });
+        }
+      }, [this, &resultQueue, id, size, wantsResult](kj::Exception&& exception) {
+        queuedBytes.fetch_sub(size, std::memory_order_relaxed);
+        if (wantsResult) {
+          resultQueue.send(Result { id, false, kj::mv(exception) });
+        }
+      });
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, exception);
+    }
+  };
+
+  class RemoteDeliveryQueue final: public MailQueue, public SpoolingQueue,
+                                  private kj::TaskSet::ErrorHandler {
+    // A worker thread's MailQueue. Converts each message to an EmailMessage here, on the worker,
+    // and hands the result to the hub; or, if the hub spools, hands over the raw message. Must be
+    // used only on the thread that constructed it.
+
+  public:
+    RemoteDeliveryQueue(WorkerDeliveryHub& hub, uint index, kj::LowLevelAsyncIoProvider& provider)
+        : hub(hub), index(index), tasks(*this) {
+      hub.getResults(index).bind(provider);
+      tasks.add(receiveResults());
+      if (getOptions().decodePool != nullptr) {
+        decoder = kj::heap<DecodeClient>(*getOptions().decodePool, provider);
+      }
+    }
+
+    KJ_DISALLOW_COPY(RemoteDeliveryQueue);
+
+    const DeliveryOptions& getOptions() override { return hub.getOptions(); }
+    bool isFull() override { return hub.isFull(); }
+    void countRejected() override { hub.countRejected(); }
+
+    kj::Maybe<SpoolingQueue&> getSpooling() override {
+      if (!hub.isSpooling()) {
+        return nullptr;
+      }
+      return static_cast<SpoolingQueue&>(*this);
+    }
+
+    kj::Promise<Spooled> append(kj::ArrayPtr<const char> message) override {
+      // The copy is what crosses to the RPC thread; `message` may be gone by the time it's read.
+      uint64_t id = nextId++;
+      bool wantsResult = getOptions().ackAfterDelivery;
+      auto stored = kj::newPromiseAndFulfiller<void>();
+      awaitingSpool.insert(std::make_pair(id, kj::mv(stored.fulfiller)));
+      auto delivered = awaitResult(id, wantsResult);
+      hub.submit(WorkerDeliveryHub::Job {
+          index, id, wantsResult, nullptr, kj::heapArray(message), message.size(),
+          MemoryCharge() });
+      return stored.promise.then([delivered = kj::mv(delivered)]() mutable {
+        return Spooled { kj::mv(delivered) };
+      });
+    }
+
+    kj::Promise<void> enqueue(kj::Own<GMimeMessage>&& message, uint64_t size,
+                              MemoryCharge&& charge) override {
+      auto email = kj::heap<capnp::MallocMessageBuilder>(emailSizeHint(size).wordCount);
+      kj::Promise<void> built = nullptr;
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        built = EmailTranslator(decoder.get(), translatorScratch)
+            .buildEmail(email->initRoot<sandstorm::EmailMessage>(), message.get());
+      })) {
+        // Same outcome as a message the DeliveryQueue couldn't convert.
+        KJ_LOG(ERROR, "failed to deliver message", *exception);
+        return kj::mv(*exception);
+      }
+
+      auto handedOff = built.then([this, email = kj::mv(email), message = kj::mv(message), size,
+                                   charge = kj::mv(charge)]() mutable {
+        message = nullptr;
+        return submit(kj::mv(email), size, kj::mv(charge));
+      }, [](kj::Exception&& exception) -> kj::Promise<void> {
+        KJ_LOG(ERROR, "failed to deliver message", exception);
+        return kj::mv(exception);
+      }).fork();
+      // The caller may drop its branch as soon as it has acknowledged the message, so `tasks`
+      // holds another to see the message through to the hub. Failures are logged above.
+      tasks.add(handedOff.addBranch().then([]() {}, [](kj::Exception&& exception) {}));
+      return handedOff.addBranch();
+    }
+
+  private:
+    WorkerDeliveryHub& hub;
+    uint index;
+    uint64_t nextId = 0;
+    std::map<uint64_t, kj::Own<kj::PromiseFulfiller<void>>> waiting;
+    std::map<uint64_t, kj::Own<kj::PromiseFulfiller<void>>> awaitingSpool;
+    kj::Array<kj::byte> translatorScratch = kj::heapArray<kj::byte>(TRANSLATOR_SCRATCH_SIZE);
+    kj::Own<DecodeClient> decoder;
+    kj::TaskSet tasks;
+
+    kj::Promise<void> submit(kj::Own<capnp::MallocMessageBuilder>&& email, uint64_t size,
+                             MemoryCharge&& charge) {
+      bool wantsResult = getOptions().ackAfterDelivery;
+      uint64_t id = nextId++;
+      auto result = awaitResult(id, wantsResult);
+      hub.submit(WorkerDeliveryHub::Job {
+          index, id, wantsResult, kj::mv(email), nullptr, size, kj::mv(charge) });
+      return kj::mv(result);
+    }
+
+    kj::Promise<void> awaitResult(uint64_t id, bool wantsResult) {
+      // Resolves with the delivery result for `id`, if the hub is going to send one.
+      if (!wantsResult) {
+        return kj::READY_NOW;
+      }
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      waiting.insert(std::make_pair(id, kj::mv(paf.fulfiller)));
+      return kj::mv(paf.promise);
+    }
+
+    kj::Promise<void> receiveResults() {
+      return hub.getResults(index).receive().then([this](kj::Vector<WorkerDeliveryHub::Result>&& batch) {
+        for (auto& result: batch) {
+          auto& pending = result.spooled ? awaitingSpool : waiting;
+          auto iter = pending.find(result.id);
+          KJ_ASSERT(iter != pending.end());
+          KJ_IF_MAYBE(error, result.error) {
+            if (result.spooled) {
+              // Never queued, so no delivery result will follow.
+              waiting.erase(result.id);
+            }
+            iter->second->reject(kj::mv(*error));
+          } else {
+            iter->second->fulfill();
+          }
+          pending.erase(iter);
+        }
+        return receiveResults();
+      });
+    }
+
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, exception);
+    }
+  };
+
+  }  // namespace smtp
+}  // namespace sandstorm